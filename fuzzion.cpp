@@ -11,8 +11,36 @@
 //
 //------------------------------------------------------------------------------------
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <random>
 #include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include "api/BamReader.h"
+#include <zstd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#include <fcntl.h>
+#include <unistd.h>
 
 const std::string VERSION = "fuzzion 2.0";
 
@@ -21,10 +49,303 @@ const int MIN_TARGET_LENGTH = 8; // a target sequence must be at least this long
 const int DEFAULT_MAXSUB = 2;    // default maximum substitutions allowed
 int maxsub = DEFAULT_MAXSUB;     // maximum substitutions allowed when matching
 
+const int CLUSTER_RADIUS  = 2;   // most bases by which a target sequence may differ
+                                 // from the center of its cluster
+const int CLUSTER_BENEFIT = 2;   // factor by which a cluster must reduce the bases
+                                 // compared before it is formed
+
+int overhang   = 0;                 // bases a target may extend past a read end
+int minoverlap = MIN_TARGET_LENGTH; // bases of an overhanging target to be matched
+
+bool clusterMode = false;        // true if hits are aggregated by junction
+
+const int MAX_EXAMPLES = 3;      // example read names reported per junction cluster
+
+std::string counts_filename = ""; // name of file to receive counts per label
+std::string umi_source      = ""; // tag holding the UMI, or "name" for read-name suffix
+
+bool readGroupMode = false;      // true if hits are reported by read group
+
+std::string matrix_prefix = "";  // prefix of files receiving the cell x label matrix
+
+double sampleFraction = 1.0;     // fraction of reads sampled for matching
+
+const unsigned int SAMPLE_SEED = 1;  // seed of the random sampler, for reproducibility
+const double CONFIDENCE_Z      = 1.96; // z-score of a 95% confidence interval
+const int SAMPLE_WINDOW        = 16384; // bases per window sampled using an index
+
+long totalReads   = 0;           // number of reads examined in the BAM file
+long sampledReads = 0;           // number of these that were matched to target pairs
+long numWindows     = 0;        // windows of the reference sequences, if sampled
+long windowsSampled = 0;        // number of these whose reads were matched
+
+bool hugePages = true;           // true if large tables should use huge pages
+bool showStats = false;          // true if statistics are written to stderr
+
+bool optimizeMode = false;       // true if the target pairs are optimized, not sought
+
+bool longMode = false;           // true if target sequences are found from seeds
+long matchedBases = 0;           // number of bases in the reads matched
+
+const int MAX_SEED_LENGTH = 32;  // most bases in a seed, which are packed in 64 bits
+const int SEED_WINDOW     = 4096; // seeds of a read looked up at a time
+
+int numThreads = 1;              // threads among which a long read is divided
+const int MIN_CHUNK_LENGTH = 65536; // fewest seed positions given to a thread
+
+bool ampliconMode = false;       // true if pairs are chosen by the primer of a read
+int slack = 2;                   // bases a primed junction may lie outside range
+long primedReads = 0;            // number of reads found to have a known primer
+
+const int MAX_PRIMER_LENGTH = 32; // most bases in a primer, packed in 64 bits
+
+std::string outcompress = "";    // compression of the output, or empty if none
+const int ZSTD_LEVEL = 3;        // zstd compression level of the output
+
+bool daemonMode = false;         // true if queries are read from stdin
+long memoryBudget = 4096;        // megabytes of reads kept in memory by the daemon
+long queryNumber  = 0;           // number of daemon queries so far
+
+long maxhits = 0;                // hits after which a label is no longer sought, or 0
+bool saturated = false;          // true if a label has reached maxhits
+
+double deadline = 0.0;           // seconds after which reading stops, or 0
+bool deadlineReached = false;    // true if reading stopped at the deadline
+double scannedFraction = -1.0;   // estimated fraction of input read, or -1 if unknown
+
+const int PARTIAL_STATUS = 2;    // exit status when the deadline is reached
+
+std::string genes_filename = ""; // name of FASTA file of partner gene transcripts
+
+const int GENE_KMER_LENGTH = 16; // length of k-mers identifying partner genes
+const int GENE_KMER_MIN    = 12; // fewest bases of a k-mer prefix worth seeking
+int geneRunLength = GENE_KMER_LENGTH; // bases every match shares exactly with a gene
+
 std::string bam_filename = "";   // name of BAM file (specified on command line)
 
 typedef std::vector<std::string> StringVector;
 
+#ifdef __GNUC__
+#define PREFETCH(address) __builtin_prefetch(address)
+#else
+#define PREFETCH(address)
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD // instructions beyond SSE2 are selected at run time
+#endif
+
+//------------------------------------------------------------------------------------
+
+void *allocateLarge(size_t bytes);
+void  deallocateLarge(void *p, size_t bytes);
+
+const size_t HUGE_PAGE_SIZE = 2 << 20; // bytes in a huge page
+
+//------------------------------------------------------------------------------------
+
+template <typename T>
+class LargeAllocator // allocates the elements of large, randomly accessed vectors
+{
+public:
+   typedef T value_type;
+
+   LargeAllocator() { }
+   template <typename U> LargeAllocator(const LargeAllocator<U>&) { }
+
+   T *allocate(size_t n) { return (T *)allocateLarge(n * sizeof(T)); }
+   void deallocate(T *p, size_t n) { deallocateLarge(p, n * sizeof(T)); }
+
+   template <typename U> struct rebind { typedef LargeAllocator<U> other; };
+
+   bool operator==(const LargeAllocator&) const { return true;  }
+   bool operator!=(const LargeAllocator&) const { return false; }
+};
+
+//------------------------------------------------------------------------------------
+
+class Arena // allocates memory from large blocks that are never de-allocated
+{
+public:
+   Arena() : avail(NULL), availBytes(0) { }
+
+   void *allocate(size_t bytes);
+   void  release();
+
+private:
+   char  *avail;      // next unallocated byte in the current block
+   size_t availBytes; // number of unallocated bytes in the current block
+
+   std::vector<std::pair<void *, size_t> > block; // blocks allocated so far
+};
+
+const size_t ARENA_BLOCK_SIZE = HUGE_PAGE_SIZE; // bytes in a block of an arena
+
+Arena targetArena; // holds the target pairs and their target sequences
+
+//------------------------------------------------------------------------------------
+
+class OutputBuffer // collects the output in two page-aligned buffers, handing each
+{                  // full one to stdout without copying when stdout is a pipe
+public:
+   OutputBuffer() : bytesIn(0), bytesOut(0), size(0), used(0), current(0),
+                    toPipe(false), zstd(NULL), input(NULL), inputUsed(0),
+                    pending(false), fd(STDOUT_FILENO)
+   { buffer[0] = buffer[1] = NULL; }
+
+   void write(const char *data, size_t len);
+   void flush();
+   void close();
+   void discard();
+   void redirect(int newfd) { fd = newfd; }
+
+   OutputBuffer& operator<<(const std::string& s)
+   { write(s.data(), s.length()); return *this; }
+
+   OutputBuffer& operator<<(const char *s) { write(s, std::strlen(s)); return *this; }
+   OutputBuffer& operator<<(char ch)       { write(&ch, 1); return *this; }
+   OutputBuffer& operator<<(int n)         { return *this << std::to_string(n); }
+   OutputBuffer& operator<<(long n)        { return *this << std::to_string(n); }
+
+   long bytesIn;  // bytes of output written
+   long bytesOut; // bytes of output written to stdout, after any compression
+
+private:
+   void open();
+   void mapBuffer(int i);
+   void nextBuffer();
+   void compress(ZSTD_EndDirective mode);
+   void writeBuffer(const char *data, size_t len, bool splice);
+
+   char  *buffer[2]; // filled alternately
+   size_t size;      // bytes in each buffer
+   size_t used;      // bytes filled in the current buffer
+   int    current;   // subscript of the buffer being filled
+   bool   toPipe;    // true if full buffers are spliced into a pipe
+
+   ZSTD_CCtx *zstd;  // compresses the output into the buffers, or NULL if none
+   char  *input;     // output awaiting compression
+   size_t inputUsed; // bytes of output awaiting compression
+   bool   pending;   // true if a zstd frame is yet to be ended
+
+   int fd;           // file descriptor receiving the output
+};
+
+const size_t OUTPUT_BUFFER_SIZE = 1 << 20; // bytes requested for the pipe and buffers
+
+OutputBuffer output; // matching reads and clusters written to stdout
+
+//------------------------------------------------------------------------------------
+
+class KmerHash // maps each k-mer of a static set to its subscript in the set using a
+{              // perfect hash function; other k-mers are rejected by fingerprint
+public:
+   KmerHash() : numBuckets(0), tableSize(0), seed(0) { }
+
+   void build(const std::vector<unsigned long>& kmers);
+
+   void findAll(const std::vector<unsigned long>& kmers,
+                std::vector<int>& subs) const;
+
+private:
+   struct Slot
+   {
+      unsigned int fingerprint; // identifies the k-mer in this slot
+      int sub;                  // subscript of the k-mer, or -1 if the slot is empty
+   };
+
+   bool tryBuild(const std::vector<unsigned long>& kmers);
+
+   size_t bucketOf(unsigned long h1) const;
+   size_t positionOf(unsigned long h2, unsigned short pilot) const;
+
+   static unsigned int fingerprintOf(unsigned long h1, unsigned long h2);
+
+   size_t numBuckets;                 // number of buckets of k-mers
+   size_t tableSize;                  // number of slots, slightly more than k-mers
+   unsigned long seed;                // seed of the hash functions
+   std::vector<unsigned short, LargeAllocator<unsigned short> > pilot; // per bucket
+   std::vector<Slot, LargeAllocator<Slot> > table;
+};
+
+const double KMER_HASH_LOAD     = 0.99; // fraction of slots holding a k-mer
+const double KMER_HASH_BUCKETS  = 6.0;  // buckets per k-mer, times log2(#k-mers)
+const int    KMER_HASH_ATTEMPTS = 10;   // seeds tried before giving up
+const int    KMER_HASH_DISTANCE = 8;    // k-mers between prefetch and use of memory
+
+//------------------------------------------------------------------------------------
+
+class KmerTree // maps each k-mer of a sorted set to its subscript in the set by a
+{              // binary search of the set stored in breadth-first (Eytzinger) order
+public:
+   KmerTree() : numKmers(0) { }
+
+   void build(const std::vector<unsigned long>& kmers);
+
+   int lowerBound(unsigned long kmer) const;
+
+   void findAll(const std::vector<unsigned long>& kmers,
+                std::vector<int>& subs) const;
+
+private:
+   int layout(const std::vector<unsigned long>& kmers, int i, int node);
+
+   int numKmers;
+   std::vector<unsigned long, LargeAllocator<unsigned long> > node; // 1-based tree
+   std::vector<int> sub;                                             // of each node
+};
+
+const int KMER_TREE_GROUP = 8;    // k-mers searched in lockstep
+const int KMER_TREE_MAX   = 8192; // most k-mers for which a KmerTree beats a KmerHash
+
+//------------------------------------------------------------------------------------
+
+class KmerIndex // maps each k-mer of a sorted set to its subscript in the set, using
+{               // a KmerTree for a small set and a KmerHash for a large one
+public:
+   KmerIndex() : useTree(false) { }
+
+   // the tree is built for a large set too when range queries are needed
+
+   void build(const std::vector<unsigned long>& kmers, bool ranges = false)
+   {
+      useTree = (kmers.size() <= (size_t)KMER_TREE_MAX);
+
+      if (useTree || ranges)
+         tree.build(kmers); // fits in cache and needs no hashing
+      if (!useTree)
+         hash.build(kmers); // takes two memory accesses per k-mer
+   }
+
+   int lowerBound(unsigned long kmer) const { return tree.lowerBound(kmer); }
+
+   void findAll(const std::vector<unsigned long>& kmers, std::vector<int>& subs) const
+   {
+      if (useTree)
+         tree.findAll(kmers, subs);
+      else
+         hash.findAll(kmers, subs);
+   }
+
+   bool usesTree() const { return useTree; }
+
+private:
+   bool     useTree; // true if the tree is used instead of the hash table
+   KmerTree tree;
+   KmerHash hash;
+};
+
+//------------------------------------------------------------------------------------
+
+struct TargetCluster // target sequences of equal length that differ from one of them,
+{                    // the center, in no more than CLUSTER_RADIUS bases
+   int  seqlen;      // length of these target sequences
+   int  size;        // number of these target sequences
+   int  center;      // subscript of the center
+   int *member;      // subscripts of these target sequences in ascending order
+   int *distance;    // number of bases in which each differs from the center
+};
+
 //------------------------------------------------------------------------------------
 
 class Target // represents one or more target sequences
@@ -32,13 +353,14 @@ class Target // represents one or more target sequences
 public:
    Target(const std::string& targetString);
 
-   ~Target();
+   static void *operator new(size_t bytes) { return targetArena.allocate(bytes); }
+   static void  operator delete(void *) { } // memory is owned by targetArena
 
    std::string reverseComplement() const;
 
-   bool findLeftmost (const char *readseq, int readseqlen, int rightpad,
+   bool findLeftmost (const char *readseq, int readseqlen, int minEnd, int rightpad,
                       int& matchIndex, int& matchStart) const;
-   bool findRightmost(const char *readseq, int readseqlen, int leftpad,
+   bool findRightmost(const char *readseq, int readseqlen, int leftpad, int maxStart,
                       int& matchIndex, int& matchStart) const;
 
    bool   want;      // true if we want to find any one of these target sequences
@@ -47,6 +369,65 @@ public:
    int    seqcount;  // number of target sequences in this set
    int   *seqlen;    // array containing target sequence lengths
    char **seq;       // array containing target sequences
+
+   int clustercount;       // number of clusters of similar target sequences
+   TargetCluster *cluster; // array containing the clusters
+                           // (arrays and sequences are allocated from targetArena)
+private:
+   void clusterSequences();
+
+   int matchCluster(const TargetCluster& cl, const char *readseq, int offset,
+                    int count, int limit) const;
+};
+
+//------------------------------------------------------------------------------------
+
+struct Match // identifies the target sequences of a pair found in a read sequence
+{
+   int leftIndex,  leftStart;  // matching left  target sequence and its start index
+   int rightIndex, rightStart; // matching right target sequence and its start index
+};
+
+struct SharedMatch // result of matching a read to the pairs having the same targets
+{
+   SharedMatch() : read(-1), found(false) { }
+
+   static void *operator new(size_t bytes) { return targetArena.allocate(bytes); }
+   static void  operator delete(void *) { } // memory is owned by targetArena
+
+   long  read;  // number of the read last matched, or -1 if none
+   bool  found; // true if the targets were found in that read
+   Match match; // identifies the matching target sequences if found
+};
+
+//------------------------------------------------------------------------------------
+
+struct Tally // counts the hits to a label within one read group
+{
+   Tally() : reads(0), lastRead(-1), window(0), windowReads(0), windowSquares(0),
+             untagged(0) { }
+
+   long reads;                             // number of distinct reads hit
+   long lastRead;                          // number of the read last counted, or -1
+   long window;                            // number of the window last counted
+   long windowReads;                       // reads counted in that window
+   double windowSquares;                   // sum of squared reads of earlier windows
+   std::unordered_set<unsigned long> umis; // distinct (UMI, junction position) hashes
+   long untagged;                          // reads without a UMI, each a molecule
+};
+
+struct LabelCounts // counts the hits to all target pairs having the same label
+{
+   LabelCounts(const std::string& inLabel, int inSub)
+      : label(inLabel), sub(inSub), hits(0) { }
+
+   static void *operator new(size_t bytes) { return targetArena.allocate(bytes); }
+   static void  operator delete(void *) { } // memory is owned by targetArena
+
+   const std::string& label; // from labelPool
+   int sub;                  // subscript of this object in labelCounts
+   long hits;                // number of hits in all read groups
+   std::vector<Tally> tally; // indexed by read group subscript
 };
 
 //------------------------------------------------------------------------------------
@@ -59,21 +440,129 @@ public:
 
    ~TargetPair() { delete left; delete right; }
 
+   static void *operator new(size_t bytes) { return targetArena.allocate(bytes); }
+   static void  operator delete(void *) { } // memory is owned by targetArena
+
    TargetPair *createReverseComplement() const;
 
-   void findMatch (const std::string& readName, const std::string& readString) const;
+   bool findMatch (const std::string& readString, Match& match) const;
 
    void writeMatch(const std::string& readName, const std::string& readString,
-                   int leftIndex,  int leftStart,
-		   int rightIndex, int rightStart) const;
+                   const Match& match, const std::string& readGroupName) const;
+
+   int junctionPosition(const Match& match, int readseqlen) const;
+
+   void junctionRange(int readseqlen, int& first, int& last) const;
 
-   std::string label;
+   const std::string& label;  // from labelPool
    Target *left, *right;
+   const TargetPair *forward; // pair as read from input, or one it was derived from
+   LabelCounts *counts;       // counts shared by all pairs with this label
+   int leftGene, rightGene;   // genes that must be found in a read, or -1 if none
+   SharedMatch *shared;       // match shared by pairs with the same targets, or NULL
+   int minJunction;           // least junction position allowed, default is 0
+   int maxJunction;           // greatest junction position allowed, or INT_MAX
 };
 
 std::vector<TargetPair *> targetPair;
 int numTargetPairs;
 
+std::vector<TargetPair *> activePair; // target pairs still sought in the reads
+
+std::vector<LabelCounts *> labelCounts; // one per distinct label in order of input
+
+std::unordered_set<std::string> labelPool; // one copy of each distinct label
+
+StringVector geneName;                   // names of partner genes
+std::vector<unsigned long> geneKmer;     // sorted k-mers of both strands of genes
+std::vector<int> geneKmerStart;          // start of the genes of each k-mer below
+std::vector<int> geneKmerGene;           // genes containing each k-mer
+KmerIndex geneKmerIndex;                 // subscripts into geneKmer
+
+//------------------------------------------------------------------------------------
+
+struct SeedPosting // locates a seed within a target sequence
+{
+   int target; // 2 * subscript of the target pair, plus 1 for its right target
+   int index;  // subscript of the target sequence
+   int offset; // start index of the seed within the target sequence
+};
+
+struct SeedIndex // finds the seeds of one length
+{
+   int k;                            // length of these seeds
+   std::vector<unsigned long> kmer;  // distinct seeds in ascending order
+   std::vector<int> first;           // first posting of each seed, then the end
+   std::vector<SeedPosting> posting; // postings of all seeds
+   KmerIndex index;                  // subscripts into kmer
+};
+
+struct SeedState // best match of a target in the current read
+{
+   SeedState() : read(-1), index(-1), start(0) { }
+
+   long read;  // number of the read in which the target was last found, or -1
+   int  index; // subscript of the best matching target sequence
+   int  start; // start index of its match
+};
+
+struct SeedScan // finds seeds in one chunk of the current read
+{
+   std::vector<SeedState> state;     // numbered like SeedPosting::target
+   std::vector<int> pairs;           // subscripts of pairs found in the chunk
+   std::vector<unsigned long> kmers; // seeds of the current window
+   std::vector<int> position, subs;  // their start indexes and index subscripts
+};
+
+std::vector<SeedIndex> seedIndex; // one per seed length
+std::vector<SeedScan>  seedScan;  // one per thread, the first merging them all
+
+//------------------------------------------------------------------------------------
+
+struct PrimerIndex // finds the pairs of the primers of one length at one read end
+{
+   int  length; // length of these primers
+   bool atEnd;  // true if reverse-complemented primers are sought at the read end
+   std::unordered_map<unsigned long, std::vector<int> > pairs; // subscripts of the
+                // pairs of each primer, also keyed by each single substitution of it
+};
+
+std::vector<std::string> pairPrimer;  // primer of each target pair, or empty if none
+std::vector<PrimerIndex> primerIndex; // one per primer length and read end
+std::vector<int> unprimedPairs;       // pairs without a primer, sought in every read
+std::vector<int> primedPairs;         // pairs of the primer of the current read
+std::vector<int> pairsToSeek;         // these and the unprimed pairs, in order
+
+//------------------------------------------------------------------------------------
+
+struct ReadStore // reads of a BAM file kept in memory, their bases packed 4 per byte
+{
+   size_t bytes() const;
+
+   std::string filename;            // name of the BAM file
+   long lastQuery;                  // number of the query that last used these reads
+   std::vector<unsigned char> base; // bases of all reads, 2 bits each
+   std::vector<long> baseStart;     // first base of each read, then the end
+   std::vector<long> otherStart;    // first other base of each read, then the end
+   std::vector<int>  otherIndex;    // index within its read of each other base
+   std::string otherBase;           // bases other than A, C, G and T
+   std::string name;                // names of all reads
+   std::vector<long> nameStart;     // first character of each name, then the end
+};
+
+std::vector<ReadStore *> readStore; // reads of the BAM files queried recently
+
+std::vector<char> geneFound;             // true for each gene found in current read
+std::vector<int> genesFound;             // genes found in the current read
+
+StringVector readGroup(1, "");                   // names of read groups found so far
+std::unordered_map<std::string, int> readGroupSub; // subscripts of read group names
+
+StringVector cellBarcode;                            // cell barcodes found so far
+std::unordered_map<std::string, int> cellBarcodeSub; // subscripts of cell barcodes
+std::unordered_set<unsigned long> cellMolecules;     // (cell, label, UMI) hashes found
+std::unordered_map<unsigned long, int> cellCount;    // molecules per (cell, label)
+
 //------------------------------------------------------------------------------------
 // showUsage() writes the program's usage to stdout
 
@@ -82,14 +571,136 @@ void showUsage(const char *progname)
    std::cout << VERSION << std::endl << std::endl;
 
    std::cout << "Usage: " << progname
-             << " [-maxsub=N]"
+             << " [-maxsub=N] [-overhang=N] [-minoverlap=N] [-cluster]"
+             << " [-counts=FILE] [-umi=TAG|name] [-readgroups]"
+             << " [-cellmatrix=PREFIX] [-sample=FRACTION] [-maxhits=N]"
+             << " [-deadline=SECONDS] [-genes=FASTA] [-nohugepages] [-stats]"
+             << " [-long] [-threads=N] [-amplicon] [-slack=N] [-outcompress=zstd]"
              << " bam_file"
              << " < target_sequences"
              << " > matching_reads"
+             << std::endl;
+
+   std::cout << "   or: " << progname
+             << " -daemon [-memory=MB] [options] < queries" << std::endl;
+
+   std::cout << "   or: " << progname
+             << " -optimize [-overhang=N] < target_sequences > optimized_targets"
              << std::endl << std::endl;
 
-   std::cout << "  -maxsub=N  maximum substitutions allowed, default is "
+   std::cout << "  -maxsub=N           "
+             << "maximum substitutions allowed, default is "
              << DEFAULT_MAXSUB << std::endl;
+
+   std::cout << "  -overhang=N         "
+             << "maximum bases a target may extend past a read end, default is 0"
+             << std::endl;
+
+   std::cout << "  -minoverlap=N       "
+             << "minimum bases of an overhanging target, default is "
+             << MIN_TARGET_LENGTH << std::endl;
+
+   std::cout << "  -cluster            "
+             << "write one line per junction instead of one per read" << std::endl;
+
+   std::cout << "  -counts=FILE        "
+             << "write the number of reads found per label to FILE" << std::endl;
+
+   std::cout << "  -umi=TAG|name       "
+             << "also count reads with distinct UMIs taken from TAG or the read name"
+             << std::endl;
+
+   std::cout << "  -readgroups         "
+             << "report hits and counts by read group" << std::endl;
+
+   std::cout << "  -cellmatrix=PREFIX  "
+             << "write a cell x label count matrix to PREFIX.*" << std::endl;
+
+   std::cout << "  -sample=FRACTION    "
+             << "match a random fraction of the reads, default is 1" << std::endl;
+
+   std::cout << "  -maxhits=N          "
+             << "stop seeking a label after N hits" << std::endl;
+
+   std::cout << "  -deadline=SECONDS   "
+             << "stop reading after SECONDS and report partial results" << std::endl;
+
+   std::cout << "  -genes=FASTA        "
+             << "skip pairs whose partner genes in FASTA are not in a read"
+             << std::endl;
+
+   std::cout << "  -nohugepages        "
+             << "do not back large tables with huge pages" << std::endl;
+
+   std::cout << "  -stats              "
+             << "write run statistics to the standard error stream" << std::endl;
+
+   std::cout << "  -optimize           "
+             << "write the target pairs without sequences that cannot be reported"
+             << std::endl;
+
+   std::cout << "  -long               "
+             << "find target sequences from exact seeds, for long reads" << std::endl;
+
+   std::cout << "  -threads=N          "
+             << "divide long reads, or compress, with N threads, default is 1"
+             << std::endl;
+
+   std::cout << "  -amplicon           "
+             << "seek only unprimed pairs and those of the primer starting a read"
+             << std::endl;
+
+   std::cout << "  -slack=N            "
+             << "bases a primed junction may lie outside its range, default is 2"
+             << std::endl;
+
+   std::cout << "  -outcompress=zstd   "
+             << "compress the output with zstd" << std::endl;
+
+   std::cout << "  -daemon             "
+             << "answer queries of bam_file, panel_file, output_file read from stdin"
+             << std::endl;
+
+   std::cout << "  -memory=MB          "
+             << "megabytes of reads the daemon keeps in memory, default is 4096"
+             << std::endl;
+}
+
+//------------------------------------------------------------------------------------
+// getNumericOption() returns true if the argument has the form -name=N, in which
+// case the number N is stored in value
+
+template <typename T>
+bool getNumericOption(const std::string& arg, const std::string& name, T& value)
+{
+   int namelen = name.length();
+   int arglen  = arg.length();
+
+   if (arglen <= namelen + 2 || arg.substr(1, namelen + 1) != name + "=")
+      return false;
+
+   std::stringstream stream(arg.substr(namelen + 2));
+   stream >> value;
+
+   return true;
+}
+
+//------------------------------------------------------------------------------------
+// getStringOption() returns true if the argument has the form -name=S, in which case
+// the string S is stored in value
+
+bool getStringOption(const std::string& arg, const std::string& name,
+                     std::string& value)
+{
+   int namelen = name.length();
+   int arglen  = arg.length();
+
+   if (arglen <= namelen + 2 || arg.substr(1, namelen + 1) != name + "=")
+      return false;
+
+   value = arg.substr(namelen + 2);
+
+   return true;
 }
 
 //------------------------------------------------------------------------------------
@@ -105,16 +716,87 @@ bool parseArgs(int argc, char *argv[])
          continue;
 
       if (arg[0] == '-') // found an option
-         if (arglen > 8 && arg.substr(1, 7) == "maxsub=")
+      {
+         if (getNumericOption(arg, "maxsub", maxsub))
 	 {
-            std::string s = arg.substr(8);
-	    std::stringstream stream(s);
-	    stream >> maxsub;
 	    if (maxsub < 0)
                return false;
 	 }
+         else if (getNumericOption(arg, "overhang", overhang))
+	 {
+	    if (overhang < 0)
+               return false;
+	 }
+         else if (getNumericOption(arg, "minoverlap", minoverlap))
+	 {
+	    if (minoverlap < 1)
+               return false;
+	 }
+         else if (arg == "-cluster")
+            clusterMode = true;
+         else if (getStringOption(arg, "counts", counts_filename))
+            continue;
+         else if (getStringOption(arg, "umi", umi_source))
+	 {
+	    if (umi_source != "name" && umi_source.length() != 2)
+               return false; // a BAM tag has two characters
+	 }
+         else if (arg == "-readgroups")
+            readGroupMode = true;
+         else if (getStringOption(arg, "cellmatrix", matrix_prefix))
+            continue;
+         else if (getNumericOption(arg, "sample", sampleFraction))
+	 {
+	    if (sampleFraction <= 0.0 || sampleFraction > 1.0)
+               return false;
+	 }
+         else if (getNumericOption(arg, "maxhits", maxhits))
+	 {
+	    if (maxhits < 1)
+               return false;
+	 }
+         else if (getNumericOption(arg, "deadline", deadline))
+	 {
+	    if (deadline <= 0.0)
+               return false;
+	 }
+         else if (getStringOption(arg, "genes", genes_filename))
+            continue;
+         else if (arg == "-nohugepages")
+            hugePages = false;
+         else if (arg == "-stats")
+            showStats = true;
+         else if (arg == "-optimize")
+            optimizeMode = true;
+         else if (arg == "-long")
+            longMode = true;
+         else if (getNumericOption(arg, "threads", numThreads))
+	 {
+	    if (numThreads < 1)
+               return false;
+	 }
+         else if (arg == "-amplicon")
+            ampliconMode = true;
+         else if (arg == "-daemon")
+            daemonMode = true;
+         else if (getNumericOption(arg, "memory", memoryBudget))
+	 {
+	    if (memoryBudget < 1)
+               return false;
+	 }
+         else if (getStringOption(arg, "outcompress", outcompress))
+	 {
+	    if (outcompress != "zstd")
+               return false;
+	 }
+         else if (getNumericOption(arg, "slack", slack))
+	 {
+	    if (slack < 0)
+               return false;
+	 }
          else
             return false; // unrecognized option
+      }
       else
          if (bam_filename == "")
             bam_filename = arg;
@@ -122,8 +804,28 @@ bool parseArgs(int argc, char *argv[])
             return false; // extraneous argument
    }
 
-   if (bam_filename == "")
-      return false; // missing argument
+   if ((bam_filename == "") != (optimizeMode || daemonMode) ||
+       (optimizeMode && daemonMode))
+      return false; // missing or extraneous argument
+
+   if (daemonMode && (counts_filename != "" || readGroupMode || matrix_prefix != "" ||
+                      sampleFraction < 1.0 || deadline > 0.0 || genes_filename != ""))
+      return false; // only names and bases of reads are kept in memory
+
+   if (daemonMode && showStats)
+      return false; // each query reports its own summary instead
+
+   if (umi_source != "" && counts_filename == "")
+      return false; // UMI counts are written to the counts file
+
+   if (longMode && overhang > 0)
+      return false; // seeds are found only within the read
+
+   if (numThreads > 1 && !longMode && outcompress == "")
+      return false; // threads divide long reads or compress the output
+
+   if (ampliconMode && longMode)
+      return false; // pairs are chosen either by primer or by seed
 
    return true; // all command-line arguments are valid
 }
@@ -146,421 +848,3696 @@ std::string toupperSequence(const std::string& sequence)
    return upperSeq;
 }
 
-//------------------------------------------------------------------------------------
-// getDelimitedStrings() extracts delimited string values from a string and appends
-// them to a string vector
+//------------------------------------------------------------------------------------
+// getDelimitedStrings() extracts delimited string values from a string and appends
+// them to a string vector
+
+void getDelimitedStrings(const std::string& s, char delimiter, StringVector& v)
+{
+   int i = 0, len = s.length();
+
+   do
+   {
+      std::string value = "";
+
+      while (i < len && s[i] != delimiter)
+	 value += s[i++];
+
+      v.push_back(value);
+   }
+   while (i++ < len);
+}
+
+//------------------------------------------------------------------------------------
+// isACGT() returns true if the given character is A, C, G or T
+
+bool isACGT(char ch)
+{
+   ch = std::toupper(ch);
+
+   return (ch == 'A' || ch == 'C' || ch == 'G' || ch == 'T');
+}
+
+//------------------------------------------------------------------------------------
+// isAllACGT() returns true if all characters in the sequence are A, C, G or T
+
+bool isAllACGT(const std::string& sequence)
+{
+   int len = sequence.length();
+
+   for (int i = 0; i < len; i++)
+      if (!isACGT(sequence[i]))
+         return false;
+
+   return true;
+}
+
+//------------------------------------------------------------------------------------
+// allocateLarge() allocates memory for a large table; on Linux, an allocation of at
+// least one huge page is mapped from the reserved huge pages if possible, or else is
+// advised to be backed by transparent huge pages, unless huge pages are disabled
+
+void *allocateLarge(size_t bytes)
+{
+#ifdef __linux__
+   if (bytes >= HUGE_PAGE_SIZE)
+   {
+      size_t length = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+      void *p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+      if (hugePages)
+         p = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+
+      if (p == MAP_FAILED)
+      {
+         p = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+         if (p == MAP_FAILED)
+            throw std::bad_alloc();
+
+#if defined(MADV_HUGEPAGE) && defined(MADV_NOHUGEPAGE)
+         madvise(p, length, hugePages ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+#endif
+      }
+
+      return p;
+   }
+#endif
+
+   return new char[bytes];
+}
+
+//------------------------------------------------------------------------------------
+// deallocateLarge() de-allocates memory allocated by allocateLarge()
+
+void deallocateLarge(void *p, size_t bytes)
+{
+#ifdef __linux__
+   if (bytes >= HUGE_PAGE_SIZE)
+   {
+      munmap(p, (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+      return;
+   }
+#endif
+
+   delete[] (char *)p;
+}
+
+//------------------------------------------------------------------------------------
+// Arena::allocate() returns the requested number of bytes from the current block,
+// starting a new block if the current one lacks room
+
+void *Arena::allocate(size_t bytes)
+{
+   bytes = (bytes + 7) & ~(size_t)7; // keep allocations 8-byte aligned
+
+   if (bytes > availBytes)
+   {
+      availBytes = std::max(bytes, ARENA_BLOCK_SIZE);
+      avail      = (char *)allocateLarge(availBytes);
+
+      block.push_back(std::make_pair((void *)avail, availBytes));
+   }
+
+   void *p = avail;
+
+   avail      += bytes;
+   availBytes -= bytes;
+
+   return p;
+}
+
+//------------------------------------------------------------------------------------
+// Arena::release() de-allocates all blocks, without destroying the objects in them
+
+void Arena::release()
+{
+   int numBlocks = block.size();
+
+   for (int i = 0; i < numBlocks; i++)
+      deallocateLarge(block[i].first, block[i].second);
+
+   block.clear();
+
+   avail      = NULL;
+   availBytes = 0;
+}
+
+//------------------------------------------------------------------------------------
+// OutputBuffer::open() allocates the buffers; when stdout is a pipe, the pipe is
+// enlarged, and the buffers are made the size of the pipe, so that one full buffer
+// is spliced at a time
+
+void OutputBuffer::open()
+{
+   size = OUTPUT_BUFFER_SIZE;
+
+   if (outcompress == "zstd")
+   {
+      zstd = ZSTD_createCCtx();
+
+      if (!zstd)
+         throw std::bad_alloc();
+
+      ZSTD_CCtx_setParameter(zstd, ZSTD_c_compressionLevel, ZSTD_LEVEL);
+
+      // each worker thread has its own compression context; a library built
+      // without threads rejects this, and compresses in the calling thread
+      if (numThreads > 1)
+         ZSTD_CCtx_setParameter(zstd, ZSTD_c_nbWorkers, numThreads);
+
+      input   = new char[OUTPUT_BUFFER_SIZE];
+      pending = true;
+   }
+
+#if defined(__linux__) && defined(F_SETPIPE_SZ) && defined(SPLICE_F_GIFT)
+   struct stat st;
+
+   if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode))
+   {
+      fcntl(fd, F_SETPIPE_SZ, (int)OUTPUT_BUFFER_SIZE);
+
+      long pipeSize = fcntl(fd, F_GETPIPE_SZ);
+      long pageSize = sysconf(_SC_PAGESIZE);
+
+      if (pipeSize > 0 && pageSize > 0 && pipeSize % pageSize == 0)
+      {
+         size   = pipeSize;
+         toPipe = true;
+      }
+   }
+
+   mapBuffer(0);
+   mapBuffer(1);
+#else
+   buffer[0] = new char[size];
+   buffer[1] = new char[size];
+#endif
+}
+
+//------------------------------------------------------------------------------------
+// OutputBuffer::mapBuffer() maps fresh pages for a buffer, unmapping any it had
+
+void OutputBuffer::mapBuffer(int i)
+{
+#if defined(__linux__) && defined(F_SETPIPE_SZ) && defined(SPLICE_F_GIFT)
+   if (buffer[i])
+      munmap(buffer[i], size);
+
+   void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                  -1, 0);
+
+   buffer[i] = NULL;
+
+   if (p == MAP_FAILED)
+      throw std::bad_alloc();
+
+   buffer[i] = (char *)p;
+#endif
+}
+
+//------------------------------------------------------------------------------------
+// OutputBuffer::write() appends data to the current buffer, writing each buffer as
+// it fills and then filling the other one
+
+void OutputBuffer::write(const char *data, size_t len)
+{
+   if (!buffer[0])
+      open();
+
+   bytesIn += len;
+
+   if (zstd) // the output is collected for compression instead
+   {
+      pending = true;
+
+      while (len > 0)
+      {
+         size_t n = std::min(len, OUTPUT_BUFFER_SIZE - inputUsed);
+
+         std::memcpy(input + inputUsed, data, n);
+         inputUsed += n;
+         data      += n;
+         len       -= n;
+
+         if (inputUsed == OUTPUT_BUFFER_SIZE)
+            compress(ZSTD_e_continue);
+      }
+
+      return;
+   }
+
+   while (len > 0)
+   {
+      size_t n = std::min(len, size - used);
+
+      std::memcpy(buffer[current] + used, data, n);
+      used += n;
+      data += n;
+      len  -= n;
+
+      if (used == size)
+         nextBuffer();
+   }
+}
+
+//------------------------------------------------------------------------------------
+// OutputBuffer::nextBuffer() writes the full current buffer and starts filling the
+// other one; a spliced buffer is given to the pipe, whose readers may still be using
+// its pages, so it is mapped afresh
+
+void OutputBuffer::nextBuffer()
+{
+   bool splice = toPipe;
+
+   writeBuffer(buffer[current], size, splice);
+
+   if (splice)
+      mapBuffer(current);
+
+   current = 1 - current;
+   used    = 0;
+}
+
+//------------------------------------------------------------------------------------
+// OutputBuffer::compress() compresses the output awaiting compression directly into
+// the buffers; with ZSTD_e_end, the zstd frame is ended and all of it is buffered;
+// an exception is thrown if compression fails
+
+void OutputBuffer::compress(ZSTD_EndDirective mode)
+{
+   ZSTD_inBuffer in = { input, inputUsed, 0 };
+   size_t remaining;
+
+   do
+   {
+      ZSTD_outBuffer out = { buffer[current], size, used };
+
+      remaining = ZSTD_compressStream2(zstd, &out, &in, mode);
+
+      if (ZSTD_isError(remaining))
+         throw std::runtime_error(std::string("unable to compress output: ") +
+                                  ZSTD_getErrorName(remaining));
+      used = out.pos;
+
+      if (used == size)
+         nextBuffer();
+   }
+   while (mode == ZSTD_e_continue ? in.pos < in.size : remaining > 0);
+
+   inputUsed = 0;
+}
+
+//------------------------------------------------------------------------------------
+// OutputBuffer::flush() writes the current buffer if it holds any output, having
+// first ended any zstd frame; since a partial buffer would be refilled before a full
+// one is spliced after it, its bytes are copied
+
+void OutputBuffer::flush()
+{
+   if (!buffer[0])
+   {
+      if (outcompress == "")
+         return;
+
+      open(); // compressed output is a zstd frame even if empty
+   }
+
+   if (pending)
+   {
+      compress(ZSTD_e_end);
+      pending = false;
+   }
+
+   if (used > 0)
+      writeBuffer(buffer[current], used, false);
+
+   used = 0;
+}
+
+//------------------------------------------------------------------------------------
+// OutputBuffer::close() writes any remaining output and de-allocates the buffers, so
+// that the next output is written afresh, possibly to another file
+
+void OutputBuffer::close()
+{
+   flush();
+   discard();
+}
+
+//------------------------------------------------------------------------------------
+// OutputBuffer::discard() de-allocates the buffers without writing their output
+
+void OutputBuffer::discard()
+{
+   if (!buffer[0])
+      return;
+
+#if defined(__linux__) && defined(F_SETPIPE_SZ) && defined(SPLICE_F_GIFT)
+   munmap(buffer[0], size);
+   munmap(buffer[1], size);
+#else
+   delete[] buffer[0];
+   delete[] buffer[1];
+#endif
+
+   if (zstd)
+   {
+      ZSTD_freeCCtx(zstd);
+      delete[] input;
+   }
+
+   buffer[0] = buffer[1] = NULL;
+   zstd      = NULL;
+   input     = NULL;
+   size      = used = inputUsed = 0;
+   current   = 0;
+   toPipe    = pending = false;
+}
+
+//------------------------------------------------------------------------------------
+// OutputBuffer::writeBuffer() writes bytes to stdout, splicing their pages into the
+// pipe if requested, or copying them; an exception is thrown if this fails
+
+void OutputBuffer::writeBuffer(const char *data, size_t len, bool splice)
+{
+   while (len > 0)
+   {
+      ssize_t n;
+
+#if defined(__linux__) && defined(F_SETPIPE_SZ) && defined(SPLICE_F_GIFT)
+      if (splice)
+      {
+         struct iovec iov = { (void *)data, len };
+         n = vmsplice(fd, &iov, 1, SPLICE_F_GIFT);
+
+         if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+         {
+            toPipe = splice = false; // splicing is unsupported, so copy instead
+            continue;
+         }
+      }
+      else
+#endif
+         n = ::write(fd, data, len);
+
+      if (n < 0 && errno == EINTR)
+         continue;
+
+      if (n <= 0)
+         throw std::runtime_error("unable to write output");
+
+      data     += n;
+      len      -= n;
+      bytesOut += n;
+   }
+}
+
+//------------------------------------------------------------------------------------
+// internLabel() returns the copy of a label held by the label pool
+
+const std::string& internLabel(const std::string& label)
+{
+   return *labelPool.insert(label).first;
+}
+
+//------------------------------------------------------------------------------------
+// Target::Target() parses the given string to obtain one or more target sequences and
+// saves them in the new object it is constructing
+
+Target::Target(const std::string& targetString)
+{
+   std::string s = toupperSequence(targetString);
+
+   if (s.length() > 0 && s[0] == '-')
+   {
+      want = false;
+      s = s.substr(1);
+   }
+   else
+      want = true;
+
+   StringVector t;
+   getDelimitedStrings(s, '|', t);
+
+   seqcount  = t.size();
+   minseqlen = t[0].length();
+   maxseqlen = t[0].length();
+
+   for (int i = 1; i < seqcount; i++)
+      if (t[i].length() < minseqlen)
+         minseqlen = t[i].length();
+      else if (t[i].length() > maxseqlen)
+         maxseqlen = t[i].length();
+
+   if (minseqlen < MIN_TARGET_LENGTH)
+      throw std::runtime_error("invalid sequence length in " + targetString);
+
+   for (int i = 0; i < seqcount; i++)
+      if (!isAllACGT(t[i]))
+         throw std::runtime_error("invalid character in " + t[i]);
+
+   seqlen = (int   *)targetArena.allocate(seqcount * sizeof(int));
+   seq    = (char **)targetArena.allocate(seqcount * sizeof(char *));
+
+   for (int i = 0; i < seqcount; i++)
+   {
+      seqlen[i] = t[i].length();
+      seq[i]    = (char *)targetArena.allocate(seqlen[i] + 1);
+      std::strcpy(seq[i], t[i].c_str());
+   }
+
+   clusterSequences();
+}
+
+//------------------------------------------------------------------------------------
+// complementBase() swaps A and T, and C and G; other characters are unchanged
+
+inline char complementBase(char ch)
+{
+   switch (ch)
+   {
+      case 'A': return 'T';
+      case 'a': return 't';
+
+      case 'T': return 'A';
+      case 't': return 'a';
+
+      case 'C': return 'G';
+      case 'c': return 'g';
+
+      case 'G': return 'C';
+      case 'g': return 'c';
+
+      default : return ch;
+   }
+}
+
+#ifdef HAVE_X86_SIMD
+//------------------------------------------------------------------------------------
+// reverseComplementSSSE3() reverse-complements 16 characters at a time, reversing
+// them with one shuffle and complementing them with another that looks up the XOR
+// mask for each character by its low four bits (A/T differ by 0x15, C/G by 0x04)
+
+__attribute__((target("ssse3")))
+int reverseComplementSSSE3(const char *seq, int len, char *out)
+{
+   const __m128i reverse  = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+                                          7, 6, 5, 4, 3, 2, 1, 0);
+   const __m128i xorMask  = _mm_setr_epi8(0, 0x15, 0, 0x04, 0x15, 0, 0, 0x04,
+                                          0, 0, 0, 0, 0, 0, 0, 0);
+   const __m128i lowBits  = _mm_set1_epi8(0x0F);
+   const __m128i lowerBit = _mm_set1_epi8(0x20);
+
+   int i = 0;
+
+   for (; i + 16 <= len; i += 16)
+   {
+      __m128i v = _mm_loadu_si128((const __m128i *)&seq[len - i - 16]);
+      v = _mm_shuffle_epi8(v, reverse);
+
+      __m128i lower  = _mm_or_si128(v, lowerBit);
+      __m128i isBase = _mm_or_si128(
+                          _mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('a')),
+                                       _mm_cmpeq_epi8(lower, _mm_set1_epi8('c'))),
+                          _mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('g')),
+                                       _mm_cmpeq_epi8(lower, _mm_set1_epi8('t'))));
+
+      __m128i code = _mm_and_si128(v, lowBits);
+      __m128i mask = _mm_and_si128(_mm_shuffle_epi8(xorMask, code), isBase);
+
+      _mm_storeu_si128((__m128i *)&out[i], _mm_xor_si128(v, mask));
+   }
+
+   return i; // number of characters written
+}
+#endif
+
+//------------------------------------------------------------------------------------
+// reverseComplement() writes the reverse complement of a sequence of len characters
+// to out, which must have room for len characters
+
+void reverseComplement(const char *seq, int len, char *out)
+{
+   int i = 0;
+
+#ifdef HAVE_X86_SIMD
+   static const bool hasSSSE3 = __builtin_cpu_supports("ssse3");
+
+   if (hasSSSE3)
+      i = reverseComplementSSSE3(seq, len, out);
+#endif
+
+   for (; i < len; i++)
+      out[i] = complementBase(seq[len - 1 - i]);
+}
+
+//------------------------------------------------------------------------------------
+// Target::reverseComplement() returns a string representing the reverse complement of
+// the target sequence(s)
+
+std::string Target::reverseComplement() const
+{
+   std::string revcomp = (want ? "" : "-");
+
+   for (int i = 0; i < seqcount; i++)
+   {
+      std::string temp(seqlen[i], ' ');
+      ::reverseComplement(seq[i], seqlen[i], &temp[0]);
+
+      revcomp += (i > 0 ? "|" + temp : temp);
+   }
+
+   return revcomp;
+}
+
+//------------------------------------------------------------------------------------
+// isMatch() performs a fuzzy match of two sequences; it returns true if the target
+// sequence matches the read sequence with no more than limit substitutions
+
+inline bool isMatch(const char *readseq, const char *target, int targetlen, int limit)
+{
+   int numsubs = 0;
+
+   for (int i = 0; i < targetlen; i++)
+      if (readseq[i] != target[i] && ++numsubs > limit)
+         return false;
+
+   return true;
+}
+
+//------------------------------------------------------------------------------------
+// countMismatches() returns the number of positions at which two sequences differ,
+// or limit + 1 if they differ in more than limit positions
+
+inline int countMismatches(const char *readseq, const char *target, int targetlen,
+                           int limit)
+{
+   int numsubs = 0;
+
+   for (int i = 0; i < targetlen; i++)
+      if (readseq[i] != target[i] && ++numsubs > limit)
+         break;
+
+   return numsubs;
+}
+
+#ifdef __SSE2__
+//------------------------------------------------------------------------------------
+// matchWindows() compares a target sequence to the read sequence starting at each of
+// 16 consecutive positions, counting the substitutions of all 16 alignments at once
+// with saturation; it returns a mask whose bit j is set if the alignment starting at
+// position j has no more than limit substitutions, stopping once none can
+
+inline int matchWindows(const char *readseq, const char *target, int targetlen,
+                        int limit)
+{
+   const __m128i one   = _mm_set1_epi8(1);
+   const __m128i zero  = _mm_setzero_si128();
+   const __m128i bound = _mm_set1_epi8((char)limit);
+
+   __m128i numsubs = zero;
+
+   for (int i = 0; i < targetlen; i++)
+   {
+      __m128i read = _mm_loadu_si128((const __m128i *)&readseq[i]);
+      __m128i same = _mm_cmpeq_epi8(read, _mm_set1_epi8(target[i]));
+
+      numsubs = _mm_adds_epu8(numsubs, _mm_andnot_si128(same, one));
+
+      if ((i & 3) == 3 &&
+          _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(numsubs, bound), zero)) == 0)
+         return 0; // every alignment exceeds the limit
+   }
+
+   return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(numsubs, bound), zero));
+}
+#endif
+
+//------------------------------------------------------------------------------------
+// findFirstWindow() returns the first start index from first through last at which
+// a target sequence matches the read sequence with no more than limit substitutions,
+// or last + 1 if there is none; the target sequence must lie within the read
+// sequence at every start index in this range
+
+inline int findFirstWindow(const char *readseq, int first, int last,
+                           const char *target, int targetlen, int limit)
+{
+   int start = first;
+
+#ifdef __SSE2__
+   if (limit < 255) // the counts saturate at 255
+      for ( ; start + 15 <= last; start += 16)
+      {
+         int mask = matchWindows(&readseq[start], target, targetlen, limit);
+
+         if (mask != 0)
+            return start + __builtin_ctz(mask);
+      }
+#endif
+
+   while (start <= last && !isMatch(&readseq[start], target, targetlen, limit))
+      start++;
+
+   return start;
+}
+
+//------------------------------------------------------------------------------------
+// findLastWindow() returns the last start index from first through last at which a
+// target sequence matches the read sequence with no more than limit substitutions,
+// or first - 1 if there is none; the target sequence must lie within the read
+// sequence at every start index in this range
+
+inline int findLastWindow(const char *readseq, int first, int last,
+                          const char *target, int targetlen, int limit)
+{
+   int start = last;
+
+#ifdef __SSE2__
+   if (limit < 255) // the counts saturate at 255
+      for ( ; start - 15 >= first; start -= 16)
+      {
+         int mask = matchWindows(&readseq[start - 15], target, targetlen, limit);
+
+         if (mask != 0)
+            return start - 15 + (31 - __builtin_clz(mask));
+      }
+#endif
+
+   while (start >= first && !isMatch(&readseq[start], target, targetlen, limit))
+      start--;
+
+   return (start >= first ? start : first - 1);
+}
+
+//------------------------------------------------------------------------------------
+// Target::clusterSequences() groups the target sequences into clusters, repeatedly
+// choosing as a center the target sequence having the most unclustered neighbors
+// within CLUSTER_RADIUS substitutions; a cluster too small to repay the wider limit
+// used when matching its center is split into clusters of one
+
+void Target::clusterSequences()
+{
+   typedef std::vector<std::pair<int, int> > DistanceVector; // (subscript, distance)
+
+   std::vector<DistanceVector> neighbor(seqcount);
+
+   for (int i = 0; i < seqcount; i++)
+      for (int j = i + 1; j < seqcount; j++)
+         if (seqlen[j] == seqlen[i])
+         {
+            int d = countMismatches(seq[j], seq[i], seqlen[i], CLUSTER_RADIUS);
+
+            if (d <= CLUSTER_RADIUS)
+            {
+               neighbor[i].push_back(std::make_pair(j, d));
+               neighbor[j].push_back(std::make_pair(i, d));
+            }
+         }
+
+   int minsize = (maxsub + CLUSTER_RADIUS + 1) * CLUSTER_BENEFIT / (maxsub + 1) + 1;
+
+   std::vector<DistanceVector> group; // members of each cluster in ascending order
+   std::vector<int> groupCenter;      // center of each cluster
+   std::vector<char> assigned(seqcount, false);
+
+   for (int numAssigned = 0; numAssigned < seqcount; )
+   {
+      int center = -1, best = -1;
+
+      for (int i = 0; i < seqcount; i++)
+         if (!assigned[i])
+         {
+            int count = 0;
+
+            for (size_t k = 0; k < neighbor[i].size(); k++)
+               count += !assigned[neighbor[i][k].first];
+
+            if (count > best)
+            {
+               center = i;
+               best   = count;
+            }
+         }
+
+      DistanceVector member(1, std::make_pair(center, 0));
+
+      for (size_t k = 0; k < neighbor[center].size(); k++)
+         if (!assigned[neighbor[center][k].first])
+            member.push_back(neighbor[center][k]);
+
+      if ((int)member.size() < minsize)
+         member.resize(1); // the neighbors may still center or join other clusters
+
+      for (size_t k = 0; k < member.size(); k++)
+         assigned[member[k].first] = true;
+
+      numAssigned += member.size();
+
+      std::sort(member.begin(), member.end());
+      group.push_back(member);
+      groupCenter.push_back(center);
+   }
+
+   clustercount = group.size();
+
+   std::vector<int> order(clustercount); // by first target sequence
+
+   for (int c = 0; c < clustercount; c++)
+      order[c] = c;
+
+   std::sort(order.begin(), order.end(),
+             [&group](int a, int b) { return group[a][0] < group[b][0]; });
+
+   cluster = (TargetCluster *)
+      targetArena.allocate(clustercount * sizeof(TargetCluster));
+
+   for (int c = 0; c < clustercount; c++)
+   {
+      const DistanceVector& member = group[order[c]];
+      TargetCluster& cl = cluster[c];
+
+      cl.seqlen   = seqlen[member[0].first];
+      cl.size     = member.size();
+      cl.center   = groupCenter[order[c]];
+      cl.member   = (int *)targetArena.allocate(cl.size * sizeof(int));
+      cl.distance = (int *)targetArena.allocate(cl.size * sizeof(int));
+
+      for (int k = 0; k < cl.size; k++)
+      {
+         cl.member[k]   = member[k].first;
+         cl.distance[k] = member[k].second;
+      }
+   }
+}
+
+//------------------------------------------------------------------------------------
+// Target::matchCluster() returns the subscript of the first target sequence of a
+// cluster that matches the read sequence with no more than limit substitutions,
+// comparing count bases starting at offset within the target sequences, or -1 if
+// none does; by the triangle inequality, a target sequence that differs from the
+// center in d bases differs from the read in at least x - d bases if the center
+// differs from it in x bases, so the center alone rules out most of the cluster
+
+inline int Target::matchCluster(const TargetCluster& cl, const char *readseq,
+                                int offset, int count, int limit) const
+{
+   if (cl.size == 1)
+      return (isMatch(readseq, &seq[cl.center][offset], count, limit) ?
+              cl.center : -1);
+
+   int x = countMismatches(readseq, &seq[cl.center][offset], count,
+                           limit + CLUSTER_RADIUS);
+
+   for (int k = 0; k < cl.size; k++)
+      if (x - cl.distance[k] <= limit &&
+          (cl.member[k] == cl.center ? x <= limit :
+           isMatch(readseq, &seq[cl.member[k]][offset], count, limit)))
+         return cl.member[k];
+
+   return -1;
+}
+
+//------------------------------------------------------------------------------------
+// allowedOverhang() returns the number of bases by which a target sequence of the
+// given length may extend past the start or end of a read sequence
+
+inline int allowedOverhang(int targetlen)
+{
+   int maxOverhang = targetlen - minoverlap;
+
+   if (maxOverhang > overhang)
+      maxOverhang = overhang;
+
+   return (maxOverhang > 0 ? maxOverhang : 0);
+}
+
+//------------------------------------------------------------------------------------
+// scaledMaxsub() returns the maximum substitutions allowed when only overlap bases of
+// a target sequence lie within the read sequence
+
+inline int scaledMaxsub(int overlap, int targetlen)
+{
+   return maxsub * overlap / targetlen;
+}
+
+//------------------------------------------------------------------------------------
+// Target::findLeftmost() identifies the target sequence that matches the given read
+// sequence with its last base farthest left in the read sequence (leaving the most
+// opportunity to find a match to the right); if found, true is returned, matchIndex
+// is set to the subscript identifying the matching target sequence, and matchStart is
+// set to the start index of the match within the read sequence; a wanted target
+// sequence may overhang the start of the read sequence, giving a negative matchStart;
+// only matches ending at or after minEnd and at least rightpad bases before the end
+// of the read sequence are considered
+
+bool Target::findLeftmost(const char *readseq, int readseqlen, int minEnd,
+                          int rightpad, int& matchIndex, int& matchStart) const
+{
+   matchIndex = -1; // no match found yet
+
+   int lastMatchEnd = readseqlen - rightpad; // exclusive end point, including ties
+
+   for (int c = 0; c < clustercount; c++)
+   {
+      const TargetCluster& cl = cluster[c];
+
+      int len       = cl.seqlen;
+      int lastStart = lastMatchEnd - len;
+      int start     = std::max(want ? -allowedOverhang(len) : 0, minEnd - len);
+      int index     = -1;
+
+      // boundary states where the target sequences overhang the start of the read
+      while (start < 0 && start <= lastStart &&
+             (index = matchCluster(cl, readseq, -start, len + start,
+                                   scaledMaxsub(len + start, len))) < 0)
+         start++;
+
+      // the center is matched within a wider limit at many start indexes at once
+      if (start >= 0)
+         for ( ; ; start++)
+         {
+            start = findFirstWindow(readseq, start, lastStart, seq[cl.center], len,
+                                    cl.size > 1 ? maxsub + CLUSTER_RADIUS : maxsub);
+
+            if (start > lastStart ||
+                (index = matchCluster(cl, &readseq[start], 0, len, maxsub)) >= 0)
+               break;
+         }
+
+      // a tie goes to the target sequence listed first
+      if (start < lastStart ||
+          (start == lastStart && (matchIndex < 0 || index < matchIndex)))
+      {
+         matchIndex   = index;
+         matchStart   = start;
+         lastMatchEnd = start + len;
+      }
+   }
+
+   return (matchIndex >= 0);
+}
+
+//------------------------------------------------------------------------------------
+// Target::findRightmost() identifies the target sequence that matches the given read
+// sequence with its first base farthest right in the read sequence (leaving the most
+// opportunity to find a match to the left); if found, true is returned, matchIndex
+// is set to the subscript identifying the matching target sequence, and matchStart is
+// set to the start index of the match within the read sequence; a wanted target
+// sequence may overhang the end of the read sequence; only matches starting from
+// leftpad through maxStart are considered
+
+bool Target::findRightmost(const char *readseq, int readseqlen, int leftpad,
+                           int maxStart, int& matchIndex, int& matchStart) const
+{
+   matchIndex = -1; // no match found yet
+
+   int lastMatchStart = leftpad; // inclusive starting point, including ties
+
+   for (int c = 0; c < clustercount; c++)
+   {
+      const TargetCluster& cl = cluster[c];
+
+      int len        = cl.seqlen;
+      int firstStart = readseqlen - len;
+      int start      = std::min(want ? firstStart + allowedOverhang(len) : firstStart,
+                                maxStart);
+      int index      = -1;
+
+      // boundary states where the target sequences overhang the end of the read
+      while (start > firstStart && start >= lastMatchStart &&
+             (index = matchCluster(cl, &readseq[start], 0, readseqlen - start,
+                                   scaledMaxsub(readseqlen - start, len))) < 0)
+         start--;
+
+      // the center is matched within a wider limit at many start indexes at once
+      if (start <= firstStart)
+         for ( ; ; start--)
+         {
+            start = findLastWindow(readseq, lastMatchStart, start, seq[cl.center],
+                                   len,
+                                   cl.size > 1 ? maxsub + CLUSTER_RADIUS : maxsub);
+
+            if (start < lastMatchStart ||
+                (index = matchCluster(cl, &readseq[start], 0, len, maxsub)) >= 0)
+               break;
+         }
+
+      // a tie goes to the target sequence listed first
+      if (start > lastMatchStart ||
+          (start == lastMatchStart && (matchIndex < 0 || index < matchIndex)))
+      {
+         matchIndex     = index;
+         matchStart     = start;
+         lastMatchStart = start;
+      }
+   }
+
+   return (matchIndex >= 0);
+}
+
+//------------------------------------------------------------------------------------
+// TargetPair::TargetPair() gets the left and right target sequences from the input
+// strings; an exception is thrown if there is something wrong
+
+TargetPair::TargetPair(const std::string& inLabel,
+                       const std::string& leftTargetString,
+                       const std::string& rightTargetString)
+   : label(internLabel(inLabel)), left(new Target(leftTargetString)),
+     right(new Target(rightTargetString)), forward(this), leftGene(-1), rightGene(-1),
+     shared(NULL), minJunction(0), maxJunction(INT_MAX)
+{
+   if (label.length() == 0)
+      throw std::runtime_error("missing label before " + leftTargetString);
+
+   if (!left->want && !right->want)
+      throw std::runtime_error("double negative specified for " + label);
+}
+
+//------------------------------------------------------------------------------------
+// TargetPair::createReverseComplement() returns a TargetPair object that represents
+// the reverse complement of this one
+
+TargetPair *TargetPair::createReverseComplement() const
+{
+   std::string leftTargetString  = right->reverseComplement();
+   std::string rightTargetString = left ->reverseComplement();
+
+   TargetPair *tp = new TargetPair(label, leftTargetString, rightTargetString);
+   tp->forward     = this;
+   tp->minJunction = minJunction;
+   tp->maxJunction = maxJunction;
+
+   return tp;
+}
+
+//------------------------------------------------------------------------------------
+// TargetPair::findMatch() returns true if this target pair can be found in the given
+// read sequence, in which case match identifies the matching target sequences; a
+// wanted left target must end, and a wanted right target start, within the junction
+// range
+
+bool TargetPair::findMatch(const std::string& readString, Match& match) const
+{
+   const char *readseq = readString.c_str();
+   int readseqlen      = readString.length();
+
+   int first, last; // junction range within the read sequence
+   junctionRange(readseqlen, first, last);
+
+   int rightpad = (right->want ?
+                   right->minseqlen - allowedOverhang(right->minseqlen) :
+                   right->maxseqlen);
+
+   return
+      left->want &&
+      left->findLeftmost(readseq, readseqlen, first,
+                         std::max(rightpad, readseqlen - last),
+                         match.leftIndex, match.leftStart) &&
+      right->findRightmost(readseq, readseqlen,
+                           match.leftStart + left->seqlen[match.leftIndex],
+                           right->want ? last : readseqlen,
+                           match.rightIndex, match.rightStart) == right->want ||
+      !left->want &&
+      right->findRightmost(readseq, readseqlen, std::max(left->maxseqlen, first),
+                           last, match.rightIndex, match.rightStart) &&
+      !left->findLeftmost (readseq, readseqlen, 0, readseqlen - match.rightStart,
+                           match.leftIndex, match.leftStart);
+}
+
+//------------------------------------------------------------------------------------
+// TargetPair::junctionPosition() returns the offset of the junction of a match from
+// the start of the read sequence, in the orientation of the input target pair
+
+int TargetPair::junctionPosition(const Match& match, int readseqlen) const
+{
+   if (forward == this)
+      return (left->want ? match.leftStart + left->seqlen[match.leftIndex] :
+                           match.rightStart);
+   else
+      return readseqlen - (right->want ? match.rightStart :
+                           match.leftStart + left->seqlen[match.leftIndex]);
+}
+
+//------------------------------------------------------------------------------------
+// TargetPair::junctionRange() gets the least and greatest junction positions allowed
+// in a read sequence of the given length, measured from its start; the junction
+// range of a reverse complement is measured from the end of the read sequence
+
+void TargetPair::junctionRange(int readseqlen, int& first, int& last) const
+{
+   if (forward == this)
+   {
+      first = minJunction;
+      last  = std::min(maxJunction, readseqlen);
+   }
+   else
+   {
+      first = std::max(readseqlen - maxJunction, 0);
+      last  = readseqlen - minJunction;
+   }
+}
+
+//------------------------------------------------------------------------------------
+// highlight() highlights a match as it is written to stdout
+
+void highlight(std::string readString, const char *target)
+{
+   int len = readString.length();
+
+   for (int i = 0; i < len; i++)
+      if (readString[i] != target[i])
+         readString[i] = std::tolower(readString[i]);
+
+   output << '[' << readString << ']';
+}
+
+//------------------------------------------------------------------------------------
+// TargetPair::writeMatch() writes a hit to stdout
+
+void TargetPair::writeMatch(const std::string& readName,
+                            const std::string& readString,
+                            const Match& match,
+                            const std::string& readGroupName) const
+{
+   int leftIndex  = match.leftIndex,  leftStart  = match.leftStart;
+   int rightIndex = match.rightIndex, rightStart = match.rightStart;
+
+   output << readName << "\t";
+
+   int initialBases = (left->want ? leftStart : rightStart);
+
+   if (initialBases > 0)
+      output << readString.substr(0, initialBases);
+
+   if (left->want)
+   {
+      int leftlen = left->seqlen[leftIndex];
+      int clipped = (leftStart < 0 ? -leftStart : 0); // bases overhanging read start
+
+      highlight(readString.substr(leftStart + clipped, leftlen - clipped),
+                &left->seq[leftIndex][clipped]);
+
+      int nextlen =
+         (right->want ? rightStart : readString.length()) - leftStart - leftlen;
+
+      if (nextlen > 0)
+         output << readString.substr(leftStart + leftlen, nextlen);
+   }
+
+   if (right->want)
+   {
+      int rightlen = right->seqlen[rightIndex];
+
+      highlight(readString.substr(rightStart, rightlen), right->seq[rightIndex]);
+
+      int nextlen = readString.length() - rightStart - rightlen;
+
+      if (nextlen > 0)
+         output << readString.substr(rightStart + rightlen, nextlen);
+   }
+
+   output << "\t" << label;
+
+   if (readGroupMode)
+      output << "\t" << readGroupName;
+
+   output << "\n";
+}
+
+//------------------------------------------------------------------------------------
+// ClusterKey identifies a junction: an input target pair, the target sequences
+// matched in the orientation of the input, the number of intervening bases, and the
+// read group
+
+struct ClusterKey
+{
+   const TargetPair *pair;
+   int leftIndex, rightIndex, gaplen, readGroup;
+
+   bool operator==(const ClusterKey& other) const
+   {
+      return pair       == other.pair       && leftIndex == other.leftIndex &&
+             rightIndex == other.rightIndex && gaplen    == other.gaplen    &&
+             readGroup  == other.readGroup;
+   }
+};
+
+struct ClusterKeyHash
+{
+   size_t operator()(const ClusterKey& key) const
+   {
+      size_t h = std::hash<const TargetPair *>()(key.pair);
+
+      h = h * 31 + key.leftIndex;
+      h = h * 31 + key.rightIndex;
+      h = h * 31 + key.gaplen;
+      h = h * 31 + key.readGroup;
+
+      return h;
+   }
+};
+
+struct Cluster // summarizes the hits at one junction
+{
+   int reads;                   // number of reads supporting the junction
+   StringVector example;        // names of the first few of these reads
+   std::vector<int> baseCount;  // counts of A, C, G, T, other at each intervening base
+};
+
+typedef std::unordered_map<ClusterKey, Cluster, ClusterKeyHash> ClusterMap;
+
+ClusterMap cluster;                 // junction clusters
+std::vector<ClusterKey> clusterKey; // keys of the clusters in order of creation
+
+//------------------------------------------------------------------------------------
+// baseSubscript() returns the subscript used to count the given base
+
+inline int baseSubscript(char ch)
+{
+   switch (ch)
+   {
+      case 'A': return 0;
+      case 'C': return 1;
+      case 'G': return 2;
+      case 'T': return 3;
+      default : return 4;
+   }
+}
+
+//------------------------------------------------------------------------------------
+// clusterMatch() adds a hit to the cluster for its junction, creating the cluster if
+// this is the first hit at the junction
+
+void clusterMatch(const TargetPair *tp, const std::string& readName,
+                  const std::string& readString, const Match& match, int rg)
+{
+   std::string gap = "";
+
+   if (tp->left->want && tp->right->want)
+   {
+      int gapStart = match.leftStart + tp->left->seqlen[match.leftIndex];
+      gap = readString.substr(gapStart, match.rightStart - gapStart);
+   }
+
+   ClusterKey key;
+   key.pair      = tp->forward;
+   key.gaplen    = gap.length();
+   key.readGroup = rg;
+
+   if (tp->forward == tp)
+   {
+      key.leftIndex  = match.leftIndex;
+      key.rightIndex = match.rightIndex;
+   }
+   else // convert to the orientation of the input
+   {
+      key.leftIndex  = match.rightIndex;
+      key.rightIndex = match.leftIndex;
+      std::string temp(key.gaplen, ' ');
+      reverseComplement(gap.data(), key.gaplen, &temp[0]);
+      gap.swap(temp);
+   }
+
+   ClusterMap::iterator it = cluster.find(key);
+
+   if (it == cluster.end())
+   {
+      it = cluster.insert(std::make_pair(key, Cluster())).first;
+      it->second.reads = 0;
+      it->second.baseCount.assign(5 * key.gaplen, 0);
+      clusterKey.push_back(key);
+   }
+
+   Cluster& c = it->second;
+
+   if (++c.reads <= MAX_EXAMPLES)
+      c.example.push_back(readName);
+
+   for (int i = 0; i < key.gaplen; i++)
+      c.baseCount[5 * i + baseSubscript(gap[i])]++;
+}
+
+//------------------------------------------------------------------------------------
+// writeClusters() writes one line per junction cluster to stdout
+
+void writeClusters()
+{
+   const char BASE[] = "ACGTN";
+
+   int numClusters = clusterKey.size();
+
+   for (int i = 0; i < numClusters; i++)
+   {
+      const ClusterKey& key = clusterKey[i];
+      const Cluster& c      = cluster[key];
+      const Target *left    = key.pair->left;
+      const Target *right   = key.pair->right;
+
+      std::string consensus = "";
+
+      for (int j = 0; j < key.gaplen; j++)
+      {
+         int best = 0;
+
+         for (int k = 1; k < 5; k++)
+            if (c.baseCount[5 * j + k] > c.baseCount[5 * j + best])
+               best = k;
+
+         consensus += BASE[best];
+      }
+
+      output << key.pair->label << "\t"
+             << (key.leftIndex  >= 0 ? left ->seq[key.leftIndex]  : "-") << "\t"
+             << (key.rightIndex >= 0 ? right->seq[key.rightIndex] : "-") << "\t"
+             << c.reads << "\t"
+             << (key.gaplen > 0 ? consensus : "-") << "\t";
+
+      int numExamples = c.example.size();
+
+      for (int j = 0; j < numExamples; j++)
+         output << (j > 0 ? "," : "") << c.example[j];
+
+      if (readGroupMode)
+         output << "\t" << readGroup[key.readGroup];
+
+      output << "\n";
+   }
+}
+
+//------------------------------------------------------------------------------------
+// getUMI() returns the unique molecular identifier of a read, taken from a tag or
+// from the suffix of the read name following the last colon or underscore
+
+std::string getUMI(const BamTools::BamAlignment& alignment)
+{
+   std::string umi = "";
+
+   if (umi_source == "name")
+   {
+      size_t pos = alignment.Name.find_last_of(":_");
+
+      if (pos != std::string::npos)
+         umi = alignment.Name.substr(pos + 1);
+   }
+   else
+      alignment.GetTag(umi_source, umi);
+
+   return umi;
+}
+
+//------------------------------------------------------------------------------------
+// getReadGroupSub() returns the subscript of a read group, adding the read group to
+// the list of those found if it is new
+
+int getReadGroupSub(const std::string& name)
+{
+   std::unordered_map<std::string, int>::iterator it = readGroupSub.find(name);
+
+   if (it != readGroupSub.end())
+      return it->second;
+
+   int rg = readGroup.size();
+
+   readGroup.push_back(name);
+   readGroupSub[name] = rg;
+
+   return rg;
+}
+
+//------------------------------------------------------------------------------------
+// readGroupOf() returns the subscript of the read group of a read, or 0 if hits are
+// not reported by read group
+
+int readGroupOf(const BamTools::BamAlignment& alignment)
+{
+   if (!readGroupMode)
+      return 0;
+
+   std::string name = "";
+
+   if (!alignment.GetTag("RG", name) || name == "")
+      name = "-";
+
+   return getReadGroupSub(name);
+}
+
+//------------------------------------------------------------------------------------
+// countMatch() counts a hit to the label of a target pair within a read group; a read
+// hitting several pairs of the label is counted once
+
+void countMatch(const TargetPair *tp, const BamTools::BamAlignment& alignment,
+                const Match& match, int rg)
+{
+   std::vector<Tally>& tally = tp->counts->tally;
+   int numTallies = tally.size();
+
+   if (rg >= numTallies)
+      tally.resize(rg + 1);
+
+   Tally& t = tally[rg];
+   bool newRead = (t.lastRead != sampledReads);
+
+   if (newRead)
+   {
+      t.lastRead = sampledReads;
+      t.reads++;
+
+      if (t.window != windowsSampled) // first read counted in this window
+      {
+         t.windowSquares += (double)t.windowReads * t.windowReads;
+         t.windowReads = 0;
+         t.window = windowsSampled;
+      }
+
+      t.windowReads++;
+   }
+
+   if (umi_source != "")
+   {
+      std::string umi = getUMI(alignment);
+
+      if (umi == "") // a read without a UMI counts as a molecule of its own
+      {
+         if (newRead)
+            t.untagged++;
+      }
+      else
+      {
+         unsigned long h = std::hash<std::string>()(umi);
+         h ^= tp->junctionPosition(match, alignment.QueryBases.length()) *
+              0x9e3779b97f4a7c15UL;
+
+         t.umis.insert(h);
+      }
+   }
+}
+
+//------------------------------------------------------------------------------------
+// estimateWindowCount() extrapolates the number of reads found for a label in the
+// sampled windows to all windows, with a confidence interval based on the variance of
+// the reads found per window, since the reads of a window are sampled together
+
+void estimateWindowCount(const Tally& t, double& estimate, double& low, double& high)
+{
+   double n = windowsSampled;
+   double N = numWindows;
+
+   double mean    = t.reads / n;
+   double squares = t.windowSquares + (double)t.windowReads * t.windowReads;
+   double s2      = 0.0; // variance of the reads found per window
+
+   if (n > 1)
+      s2 = std::max(squares - n * mean * mean, 0.0) / (n - 1);
+
+   double margin = CONFIDENCE_Z * N * std::sqrt((1 - n / N) * s2 / n);
+
+   estimate = N * mean;
+   low      = std::max(estimate - margin, (double)t.reads);
+   high     = estimate + margin;
+}
+
+//------------------------------------------------------------------------------------
+// estimateCount() extrapolates the number of sampled reads found for a label to all
+// reads, with a Wilson score confidence interval for the binomial proportion of reads
+// that are found
+
+void estimateCount(const Tally& t, double& estimate, double& low, double& high)
+{
+   if (windowsSampled > 0)
+   {
+      estimateWindowCount(t, estimate, low, high);
+      return;
+   }
+
+   double n  = sampledReads;
+   double p  = (n > 0 ? t.reads / n : 0.0);
+   double z2 = CONFIDENCE_Z * CONFIDENCE_Z;
+
+   double center = (p + z2 / (2 * n)) / (1 + z2 / n);
+   double margin = CONFIDENCE_Z * std::sqrt(p * (1 - p) / n + z2 / (4 * n * n)) /
+                   (1 + z2 / n);
+
+   estimate = p * totalReads;
+   low      = std::max(center - margin, 0.0) * totalReads;
+   high     = std::min(center + margin, 1.0) * totalReads;
+}
+
+//------------------------------------------------------------------------------------
+// writeCounts() writes the number of hits to each label to the counts file
+
+void writeCounts()
+{
+   std::ofstream out(counts_filename.c_str());
+
+   if (!out.is_open())
+      throw std::runtime_error("unable to open " + counts_filename);
+
+   int numLabels     = labelCounts.size();
+   int numReadGroups = readGroup.size();
+
+   // in read group mode, subscript 0 is reserved and never used
+
+   for (int rg = (readGroupMode ? 1 : 0); rg < numReadGroups; rg++)
+      for (int i = 0; i < numLabels; i++)
+      {
+         const std::vector<Tally>& tally = labelCounts[i]->tally;
+         int numTallies = tally.size();
+         Tally none;
+         const Tally& t = (rg < numTallies ? tally[rg] : none);
+
+         out << labelCounts[i]->label << "\t" << t.reads;
+
+         if (umi_source != "")
+            out << "\t" << t.umis.size() + t.untagged;
+
+         if (sampleFraction < 1.0 && sampledReads > 0)
+         {
+            double estimate, low, high;
+            estimateCount(t, estimate, low, high);
+
+            out << "\t" << std::llround(estimate)
+                << "\t" << std::llround(low) << "\t" << std::llround(high);
+         }
+
+         if (readGroupMode)
+            out << "\t" << readGroup[rg];
+
+         out << "\n";
+      }
+
+   if (!out.good())
+      throw std::runtime_error("unable to write " + counts_filename);
+}
+
+//------------------------------------------------------------------------------------
+// countCellMatch() counts a hit to the label of a target pair in the cell identified
+// by the CB tag of the read, provided its UB tag identifies a new molecule
+
+void countCellMatch(const TargetPair *tp, const BamTools::BamAlignment& alignment)
+{
+   std::string barcode, umi;
+
+   if (!alignment.GetTag("CB", barcode) || !alignment.GetTag("UB", umi))
+      return; // not assigned to a cell and molecule
+
+   std::unordered_map<std::string, int>::iterator it = cellBarcodeSub.find(barcode);
+   int cell;
+
+   if (it != cellBarcodeSub.end())
+      cell = it->second;
+   else
+   {
+      cell = cellBarcode.size();
+      cellBarcode.push_back(barcode);
+      cellBarcodeSub[barcode] = cell;
+   }
+
+   unsigned long entry = (unsigned long)cell * labelCounts.size() + tp->counts->sub;
+   unsigned long h     = std::hash<std::string>()(umi) ^ entry * 0x9e3779b97f4a7c15UL;
+
+   if (cellMolecules.insert(h).second)
+      cellCount[entry]++;
+}
+
+//------------------------------------------------------------------------------------
+// writeCellMatrix() writes the cell x label matrix in Matrix Market format, with one
+// row per label and one column per cell barcode, and writes the labels and barcodes
+// to accompanying files
+
+void writeCellMatrix()
+{
+   std::string matrix_filename   = matrix_prefix + ".mtx";
+   std::string barcodes_filename = matrix_prefix + ".barcodes.tsv";
+   std::string features_filename = matrix_prefix + ".features.tsv";
+
+   std::ofstream matrix  (matrix_filename.c_str());
+   std::ofstream barcodes(barcodes_filename.c_str());
+   std::ofstream features(features_filename.c_str());
+
+   if (!matrix.is_open())
+      throw std::runtime_error("unable to open " + matrix_filename);
+
+   if (!barcodes.is_open())
+      throw std::runtime_error("unable to open " + barcodes_filename);
+
+   if (!features.is_open())
+      throw std::runtime_error("unable to open " + features_filename);
+
+   int numLabels = labelCounts.size();
+
+   std::vector<unsigned long> entry;
+   entry.reserve(cellCount.size());
+
+   for (std::unordered_map<unsigned long, int>::const_iterator it = cellCount.begin();
+        it != cellCount.end(); ++it)
+      entry.push_back(it->first);
+
+   std::sort(entry.begin(), entry.end()); // column-major order
+
+   matrix << "%%MatrixMarket matrix coordinate integer general\n"
+          << numLabels << " " << cellBarcode.size() << " " << entry.size() << "\n";
+
+   int numEntries = entry.size();
+
+   for (int i = 0; i < numEntries; i++)
+      matrix << entry[i] % numLabels + 1 << " " << entry[i] / numLabels + 1 << " "
+             << cellCount[entry[i]] << "\n";
+
+   int numCells = cellBarcode.size();
+
+   for (int i = 0; i < numCells; i++)
+      barcodes << cellBarcode[i] << "\n";
+
+   for (int i = 0; i < numLabels; i++)
+      features << labelCounts[i]->label << "\n";
+
+   if (!matrix.good())
+      throw std::runtime_error("unable to write " + matrix_filename);
+
+   if (!barcodes.good())
+      throw std::runtime_error("unable to write " + barcodes_filename);
+
+   if (!features.good())
+      throw std::runtime_error("unable to write " + features_filename);
+}
+
+//------------------------------------------------------------------------------------
+// recordHit() reports a read in which a target pair was found
+
+void recordHit(const TargetPair *tp, const BamTools::BamAlignment& alignment,
+               const Match& match)
+{
+   if (++tp->counts->hits == maxhits)
+      saturated = true;
+
+   int rg = readGroupOf(alignment);
+
+   if (counts_filename != "")
+      countMatch(tp, alignment, match, rg);
+
+   if (matrix_prefix != "")
+      countCellMatch(tp, alignment);
+
+   if (clusterMode)
+      clusterMatch(tp, alignment.Name, alignment.QueryBases, match, rg);
+   else
+      tp->writeMatch(alignment.Name, alignment.QueryBases, match, readGroup[rg]);
+}
+
+//------------------------------------------------------------------------------------
+// isSaturated() returns true if the label of a target pair has reached maxhits
+
+bool isSaturated(const TargetPair *tp)
+{
+   return (maxhits > 0 && tp->counts->hits >= maxhits);
+}
+
+//------------------------------------------------------------------------------------
+// removeSaturatedPairs() removes the target pairs of saturated labels from the pairs
+// still sought
+
+void removeSaturatedPairs()
+{
+   activePair.erase(std::remove_if(activePair.begin(), activePair.end(), isSaturated),
+                    activePair.end());
+
+   saturated = false;
+}
+
+//------------------------------------------------------------------------------------
+// getJunctionLimit() returns true if a string holds a junction position, which is a
+// nonnegative integer, in which case it is stored in value
+
+bool getJunctionLimit(const std::string& s, int& value)
+{
+   std::stringstream stream(s);
+
+   return (stream >> value && stream.eof() && value >= 0);
+}
+
+//------------------------------------------------------------------------------------
+// setJunctionRange() sets the junction range of a target pair from the optional
+// fourth and fifth columns of its input line; an exception is thrown if they are
+// invalid
+
+void setJunctionRange(TargetPair *tp, const StringVector& column,
+                      const std::string& line)
+{
+   if (column.size() == 3)
+      return;
+
+   if (column.size() < 5 || !getJunctionLimit(column[3], tp->minJunction) ||
+       !getJunctionLimit(column[4], tp->maxJunction) ||
+       tp->minJunction > tp->maxJunction)
+      throw std::runtime_error("invalid junction range in " + line);
+}
+
+//------------------------------------------------------------------------------------
+// getPrimer() returns the primer in the optional sixth column of an input line, or an
+// empty string if none; an exception is thrown if it is invalid
+
+std::string getPrimer(const StringVector& column, const std::string& line)
+{
+   std::string primer = (column.size() == 6 ? toupperSequence(column[5]) : "");
+
+   if (!isAllACGT(primer) || primer.length() > MAX_PRIMER_LENGTH)
+      throw std::runtime_error("invalid primer in " + line);
+
+   return primer;
+}
+
+//------------------------------------------------------------------------------------
+// readTargetPairs() reads a list of target pairs from an input stream and stores each
+// pair and its reverse complement in a vector of target pairs
+
+void readTargetPairs(std::istream& in)
+{
+   std::string line;
+   std::unordered_map<const std::string *, LabelCounts *> countsOf; // by pooled label
+   std::unordered_map<std::string, int> pairOf; // first pair having the same targets
+
+   while (std::getline(in, line))
+   {
+      StringVector column;
+      getDelimitedStrings(line, '\t', column);
+
+      if (column.size() != 3 && column.size() != 5 && column.size() != 6)
+         throw std::runtime_error("unexpected #columns in " + line);
+
+      TargetPair *tp = new TargetPair(column[0], column[1], column[2]);
+      setJunctionRange(tp, column, line);
+
+      std::string primer = getPrimer(column, line);
+      std::string rcPrimer(primer.length(), 'N');
+      reverseComplement(primer.c_str(), primer.length(), &rcPrimer[0]);
+
+      pairPrimer.push_back(primer);
+      pairPrimer.push_back(rcPrimer);
+
+      LabelCounts *&counts = countsOf[&tp->label];
+
+      if (!counts)
+      {
+         counts = new LabelCounts(tp->label, labelCounts.size());
+         labelCounts.push_back(counts);
+      }
+
+      TargetPair *rc = tp->createReverseComplement();
+      tp->counts = rc->counts = counts;
+
+      // pairs that differ only in label share the result of matching each read
+
+      std::string targets = toupperSequence(column[1] + "\t" + column[2]);
+
+      if (column.size() >= 5)
+         targets += "\t" + column[3] + "\t" + column[4];
+
+      if (ampliconMode && primer != "")
+         targets += "\tprimed"; // range to be widened by buildPrimerIndex()
+
+      std::unordered_map<std::string, int>::iterator it = pairOf.find(targets);
+
+      if (it == pairOf.end())
+         pairOf[targets] = targetPair.size();
+      else
+      {
+         TargetPair *first   = targetPair[it->second];
+         TargetPair *firstrc = targetPair[it->second + 1]; // reverse complement
+
+         if (!first->shared)
+         {
+            first  ->shared = new SharedMatch;
+            firstrc->shared = new SharedMatch;
+         }
+
+         tp->shared = first  ->shared;
+         rc->shared = firstrc->shared;
+      }
+
+      targetPair.push_back(tp);
+      targetPair.push_back(rc);
+   }
+
+   numTargetPairs = targetPair.size();
+
+   if (numTargetPairs == 0)
+      throw std::runtime_error("no input targets");
+
+   activePair = targetPair;
+}
+
+//------------------------------------------------------------------------------------
+// findPairMatch() returns true if a target pair can be found in the current read, in
+// which case match identifies the matching target sequences; the result is reused by
+// the other pairs having the same targets
+
+inline bool findPairMatch(const TargetPair *tp, const std::string& readString,
+                          Match& match)
+{
+   SharedMatch *shared = tp->shared;
+
+   if (!shared)
+      return tp->findMatch(readString, match);
+
+   if (shared->read != sampledReads)
+   {
+      shared->read  = sampledReads;
+      shared->found = tp->findMatch(readString, shared->match);
+   }
+
+   match = shared->match;
+   return shared->found;
+}
+
+//------------------------------------------------------------------------------------
+// containsPreferred() returns true if a longer target sequence contains a shorter one
+// that always matches in preference to it: any match of the longer sequence implies
+// a match of the shorter one within it, which for a wanted left target ends sooner
+// and for a wanted right target starts later, or ties but comes first in the list;
+// when the junction range is limited, the shorter one must tie, lest it fall outside
+
+bool containsPreferred(const std::string& longer, int longerIndex,
+                       const std::string& shorter, int shorterIndex,
+                       bool want, bool isLeft, bool limited)
+{
+   size_t extra = longer.length() - shorter.length();
+
+   for (size_t pos = longer.find(shorter); pos != std::string::npos;
+        pos = longer.find(shorter, pos + 1))
+   {
+      bool tie = (isLeft ? pos == extra : pos == 0);
+
+      if (!want || (tie ? shorterIndex < longerIndex : !limited))
+         return true;
+   }
+
+   return false;
+}
+
+//------------------------------------------------------------------------------------
+// pruneTarget() returns a target string that matches exactly as the given one does,
+// omitting repeated target sequences and those containing a preferred shorter one;
+// the numbers of target sequences omitted are added to the given counts
+
+std::string pruneTarget(const std::string& targetString, bool isLeft, bool limited,
+                        int& numDuplicates, int& numContaining)
+{
+   std::string s = toupperSequence(targetString);
+   bool want = (s.length() == 0 || s[0] != '-');
+
+   if (!want)
+      s = s.substr(1);
+
+   StringVector t;
+   getDelimitedStrings(s, '|', t);
+
+   int count = t.size();
+   std::vector<char> keep(count, true);
+
+   for (int i = 1; i < count; i++)
+      for (int j = 0; j < i && keep[i]; j++)
+         if (t[j] == t[i]) // a later duplicate never matches in preference
+         {
+            keep[i] = false;
+            numDuplicates++;
+         }
+
+   // a wanted target sequence overhanging a read end is matched with a scaled limit,
+   // which a shorter target sequence within it may exceed
+
+   if (!want || overhang == 0)
+   {
+      std::vector<int> order(count); // shortest first, so removals rest on kept ones
+
+      for (int i = 0; i < count; i++)
+         order[i] = i;
+
+      std::stable_sort(order.begin(), order.end(),
+                       [&t](int a, int b) { return t[a].length() < t[b].length(); });
+
+      for (int a = 0; a < count; a++)
+         for (int b = 0; b < a && keep[order[a]]; b++)
+         {
+            int i = order[a], j = order[b];
+
+            if (keep[j] && t[j].length() < t[i].length() &&
+                containsPreferred(t[i], i, t[j], j, want, isLeft, limited))
+            {
+               keep[i] = false;
+               numContaining++;
+            }
+         }
+
+      // an unwanted target is sought clear of its longest target sequence, so one of
+      // these must remain; the first of them cannot have been a duplicate
+
+      size_t maxlen = t[order[count - 1]].length();
+      int first = -1;
+      bool kept = false;
+
+      for (int i = 0; i < count; i++)
+         if (t[i].length() == maxlen)
+         {
+            if (first < 0)
+               first = i;
+
+            kept = kept || keep[i];
+         }
+
+      if (!want && !kept)
+      {
+         keep[first] = true;
+         numContaining--;
+      }
+   }
+
+   std::string pruned = (want ? "" : "-");
+   bool empty = true;
+
+   for (int i = 0; i < count; i++)
+      if (keep[i])
+      {
+         pruned += (empty ? t[i] : "|" + t[i]);
+         empty = false;
+      }
+
+   return pruned;
+}
+
+//------------------------------------------------------------------------------------
+// optimizeTargetPairs() reads a list of target pairs from stdin and writes them to
+// stdout without the target sequences that cannot change the output, reporting the
+// savings to stderr
+
+void optimizeTargetPairs(const char *progname)
+{
+   std::string line;
+   std::unordered_set<std::string> targetsSeen;
+
+   int numPairs = 0, numSharing = 0, numDuplicates = 0, numContaining = 0;
+   long inputBases = 0, outputBases = 0;
+
+   while (std::getline(std::cin, line))
+   {
+      StringVector column;
+      getDelimitedStrings(line, '\t', column);
+
+      if (column.size() != 3 && column.size() != 5 && column.size() != 6)
+         throw std::runtime_error("unexpected #columns in " + line);
+
+      TargetPair tp(column[0], column[1], column[2]); // checks the input
+      setJunctionRange(&tp, column, line);
+      getPrimer(column, line);
+
+      bool limited = (column.size() >= 5);
+      std::string range = (limited ? "\t" + column[3] + "\t" + column[4] : "");
+
+      if (column.size() == 6)
+         range += "\t" + column[5];
+
+      std::string left  = pruneTarget(column[1], true,  limited, numDuplicates,
+                                      numContaining);
+      std::string right = pruneTarget(column[2], false, limited, numDuplicates,
+                                      numContaining);
+
+      output << column[0] << "\t" << left << "\t" << right << range << "\n";
+
+      numPairs++;
+
+      if (!targetsSeen.insert(left + "\t" + right + range).second)
+         numSharing++;
+
+      std::string input = column[1] + column[2], output = left + right;
+
+      inputBases  += std::count_if(input.begin(),  input.end(),  isACGT);
+      outputBases += std::count_if(output.begin(), output.end(), isACGT);
+   }
+
+   if (numPairs == 0)
+      throw std::runtime_error("no input targets");
+
+   output.flush();
+
+   std::cerr << progname << ": " << numDuplicates + numContaining
+             << " target sequences removed (" << numDuplicates << " repeated, "
+             << numContaining << " containing a preferred shorter one), "
+             << inputBases - outputBases << " of " << inputBases << " bases"
+             << std::endl;
+
+   std::cerr << progname << ": " << numSharing << " of " << numPairs
+             << " pairs share the matches of an earlier pair with the same targets"
+             << std::endl;
+}
+
+//------------------------------------------------------------------------------------
+// mixBits() returns a well-mixed 64-bit hash of a 64-bit value
+
+inline unsigned long mixBits(unsigned long x)
+{
+   x ^= x >> 30;
+   x *= 0xbf58476d1ce4e5b9UL;
+   x ^= x >> 27;
+   x *= 0x94d049bb133111ebUL;
+   x ^= x >> 31;
+
+   return x;
+}
+
+//------------------------------------------------------------------------------------
+// KmerHash::bucketOf() returns the bucket of a k-mer given its first hash; 60% of the
+// k-mers are placed in 30% of the buckets, so that the large buckets, which are
+// placed first, find room easily
+
+inline size_t KmerHash::bucketOf(unsigned long h1) const
+{
+   const unsigned long SKEW = 0x9999999999999999UL; // 60% of the 64-bit range
+
+   size_t dense = numBuckets * 3 / 10 + 1;
+
+   if (h1 < SKEW || dense >= numBuckets)
+      return h1 % dense;
+   else
+      return dense + h1 % (numBuckets - dense);
+}
+
+//------------------------------------------------------------------------------------
+// KmerHash::positionOf() returns the slot of a k-mer given its second hash and the
+// pilot of its bucket
+
+inline size_t KmerHash::positionOf(unsigned long h2, unsigned short pilot) const
+{
+   return (h2 ^ mixBits(pilot + 1UL)) % tableSize;
+}
+
+//------------------------------------------------------------------------------------
+// KmerHash::fingerprintOf() returns the fingerprint of a k-mer given its hashes
+
+inline unsigned int KmerHash::fingerprintOf(unsigned long h1, unsigned long h2)
+{
+   return (unsigned int)(h1 ^ h2 >> 32);
+}
+
+//------------------------------------------------------------------------------------
+// KmerHash::findAll() finds the subscript of each k-mer in a vector, or -1 if the
+// k-mer is not in the set; the lookups are pipelined in three stages so that the
+// pilot and slot of each k-mer are prefetched well before they are used
+
+void KmerHash::findAll(const std::vector<unsigned long>& kmers,
+                       std::vector<int>& subs) const
+{
+   const int D    = KMER_HASH_DISTANCE;
+   const int RING = 4 * D; // power of two exceeding the 2 * D k-mers in flight
+
+   int numKmers = kmers.size();
+   subs.assign(numKmers, -1);
+
+   if (tableSize == 0)
+      return;
+
+   unsigned long h2[RING];     // second hash of each k-mer in flight
+   unsigned int  finger[RING]; // fingerprint of each k-mer in flight
+   size_t        bucket[RING]; // bucket of each k-mer in stage 1
+   size_t        pos[RING];    // slot of each k-mer in stage 2
+
+   for (int i = -2 * D; i < numKmers; i++)
+   {
+      int j = i + 2 * D; // stage 1: hash the k-mer and prefetch its pilot
+
+      if (j < numKmers)
+      {
+         int r = j & (RING - 1);
+         unsigned long h1 = mixBits(kmers[j] + seed);
+
+         h2[r]     = mixBits(h1);
+         finger[r] = fingerprintOf(h1, h2[r]);
+         bucket[r] = bucketOf(h1);
+
+         PREFETCH(&pilot[bucket[r]]);
+      }
+
+      j = i + D; // stage 2: find the slot of the k-mer and prefetch it
+
+      if (j >= 0 && j < numKmers)
+      {
+         int r = j & (RING - 1);
+
+         pos[r] = positionOf(h2[r], pilot[bucket[r]]);
+
+         PREFETCH(&table[pos[r]]);
+      }
+
+      if (i >= 0) // stage 3: check the fingerprint in the slot
+      {
+         int r = i & (RING - 1);
+         const Slot& slot = table[pos[r]];
+
+         if (slot.fingerprint == finger[r])
+            subs[i] = slot.sub;
+      }
+   }
+}
+
+//------------------------------------------------------------------------------------
+// KmerHash::tryBuild() tries to find a pilot for each bucket that places its k-mers
+// in empty slots, considering the largest buckets first; true is returned if
+// successful
+
+bool KmerHash::tryBuild(const std::vector<unsigned long>& kmers)
+{
+   size_t numKmers = kmers.size();
+
+   tableSize  = (size_t)(numKmers / KMER_HASH_LOAD) + 1;
+   numBuckets = (size_t)(KMER_HASH_BUCKETS * numKmers /
+                         std::log2(numKmers + 2.0)) + 1;
+
+   pilot.assign(numBuckets, 0);
+
+   Slot empty = { 0, -1 };
+   table.assign(tableSize, empty);
+
+   // sort the k-mers by bucket, remembering both hashes of each
+
+   struct Entry { size_t bucket; unsigned long h1, h2; int sub; };
+   std::vector<Entry> entry(numKmers);
+
+   for (size_t i = 0; i < numKmers; i++)
+   {
+      entry[i].h1     = mixBits(kmers[i] + seed);
+      entry[i].h2     = mixBits(entry[i].h1);
+      entry[i].bucket = bucketOf(entry[i].h1);
+      entry[i].sub    = i;
+   }
+
+   std::sort(entry.begin(), entry.end(),
+             [](const Entry& a, const Entry& b) { return a.bucket < b.bucket; });
+
+   std::vector<std::pair<size_t, size_t> > bucket; // (#k-mers, first entry) pairs
+
+   for (size_t i = 0; i < numKmers; i++)
+      if (i == 0 || entry[i].bucket != entry[i - 1].bucket)
+         bucket.push_back(std::make_pair(1, i));
+      else
+         bucket.back().first++;
+
+   std::stable_sort(bucket.begin(), bucket.end(),
+                    [](const std::pair<size_t, size_t>& a,
+                       const std::pair<size_t, size_t>& b)
+                    { return a.first > b.first; });
+
+   std::vector<size_t> position;
+   int numBucketsUsed = bucket.size();
+
+   for (int b = 0; b < numBucketsUsed; b++)
+   {
+      size_t count = bucket[b].first, first = bucket[b].second;
+      int p;
+
+      for (p = 0; p <= 0xFFFF; p++)
+      {
+         position.clear();
+
+         for (size_t i = first; i < first + count; i++)
+         {
+            size_t pos = positionOf(entry[i].h2, p);
+
+            if (table[pos].sub >= 0 ||
+                std::find(position.begin(), position.end(), pos) != position.end())
+               break; // collision
+
+            position.push_back(pos);
+         }
+
+         if (position.size() == count)
+            break; // all k-mers of the bucket were placed
+      }
+
+      if (p > 0xFFFF)
+         return false;
+
+      pilot[entry[first].bucket] = p;
+
+      for (size_t i = 0; i < count; i++)
+      {
+         const Entry& e = entry[first + i];
+
+         table[position[i]].fingerprint = fingerprintOf(e.h1, e.h2);
+         table[position[i]].sub         = e.sub;
+      }
+   }
+
+   return true;
+}
+
+//------------------------------------------------------------------------------------
+// KmerHash::build() builds the perfect hash function for a set of distinct k-mers
+
+void KmerHash::build(const std::vector<unsigned long>& kmers)
+{
+   for (int attempt = 0; attempt < KMER_HASH_ATTEMPTS; attempt++)
+   {
+      seed = mixBits(attempt + 1UL);
+
+      if (tryBuild(kmers))
+         return;
+   }
+
+   throw std::runtime_error("unable to build k-mer hash table");
+}
+
+//------------------------------------------------------------------------------------
+// KmerTree::layout() places the sorted k-mers, starting with subscript i, into the
+// subtree rooted at a node by an in-order walk; the next subscript is returned
+
+int KmerTree::layout(const std::vector<unsigned long>& kmers, int i, int node)
+{
+   if (node <= numKmers)
+   {
+      i = layout(kmers, i, 2 * node);
+
+      this->node[node] = kmers[i];
+      sub[node] = i++;
+
+      i = layout(kmers, i, 2 * node + 1);
+   }
+
+   return i;
+}
+
+//------------------------------------------------------------------------------------
+// KmerTree::build() builds the tree for a sorted set of distinct k-mers
+
+void KmerTree::build(const std::vector<unsigned long>& kmers)
+{
+   numKmers = kmers.size();
+
+   node.assign(numKmers + 1, 0);
+   sub.assign(numKmers + 1, -1);
+
+   layout(kmers, 0, 1);
+}
+
+//------------------------------------------------------------------------------------
+// KmerTree::lowerBound() returns the subscript of the least k-mer of the set that is
+// not less than a given k-mer, or the number of k-mers in the set if there is none;
+// the descent is branch-free, and the nodes four levels down are prefetched
+
+int KmerTree::lowerBound(unsigned long kmer) const
+{
+   int k = 1;
+
+   while (k <= numKmers)
+   {
+      PREFETCH(&node[0] + std::min(16 * k, numKmers));
+      k = 2 * k + (node[k] < kmer);
+   }
+
+   k >>= __builtin_ffs(~k); // undo the right turns and the last left turn
+   return (k == 0 ? numKmers : sub[k]);
+}
+
+//------------------------------------------------------------------------------------
+// KmerTree::findAll() finds the subscript of each k-mer in a vector, or -1 if the
+// k-mer is not in the set; groups of k-mers descend the tree in lockstep so that
+// their memory accesses overlap without prefetching
+
+void KmerTree::findAll(const std::vector<unsigned long>& kmers,
+                       std::vector<int>& subs) const
+{
+   const int G = KMER_TREE_GROUP;
+
+   int numQueries = kmers.size();
+   subs.assign(numQueries, -1);
+
+   if (numKmers == 0)
+      return;
+
+   int depth = 0; // levels of the tree that every descent passes through
+
+   while ((2 << depth) - 1 <= numKmers)
+      depth++;
+
+   for (int first = 0; first < numQueries; first += G)
+   {
+      int count = std::min(G, numQueries - first);
+      const unsigned long *kmer = &kmers[first];
+      int k[G];
+
+      for (int g = 0; g < count; g++)
+         k[g] = 1;
+
+      for (int level = 0; level < depth; level++)
+         for (int g = 0; g < count; g++)
+            k[g] = 2 * k[g] + (node[k[g]] < kmer[g]);
+
+      for (int g = 0; g < count; g++)
+      {
+         if (k[g] <= numKmers) // the bottom level is partly filled
+            k[g] = 2 * k[g] + (node[k[g]] < kmer[g]);
+
+         k[g] >>= __builtin_ffs(~k[g]);
+
+         if (k[g] > 0 && node[k[g]] == kmer[g])
+            subs[first + g] = sub[k[g]];
+      }
+   }
+}
+
+//------------------------------------------------------------------------------------
+// getKmers() appends to a vector the 2-bit encoding of each k-mer of a sequence that
+// contains only A, C, G and T
+
+void getKmers(const std::string& sequence, int k, std::vector<unsigned long>& kmers)
+{
+   const unsigned long mask = (k < 32 ? (1UL << 2 * k) - 1 : ~0UL);
+
+   unsigned long code = 0;
+   int len = sequence.length(), valid = 0;
+
+   for (int i = 0; i < len; i++)
+   {
+      int base = baseSubscript(sequence[i]);
+
+      if (base > 3)
+      {
+         valid = 0; // start over after N
+         continue;
+      }
+
+      code = (code << 2 | base) & mask;
+
+      if (++valid >= k)
+         kmers.push_back(code);
+   }
+}
+
+//------------------------------------------------------------------------------------
+// getGeneKmers() appends to a vector each GENE_KMER_LENGTH-mer of a gene sequence;
+// the last bases before an N or the end of the sequence, down to GENE_KMER_MIN of
+// them, are appended too, padded with A, so that every k-mer of the sequence no
+// longer than GENE_KMER_LENGTH is a prefix of one appended
+
+void getGeneKmers(const std::string& sequence, std::vector<unsigned long>& kmers)
+{
+   const int k = GENE_KMER_LENGTH;
+   const unsigned long mask = (1UL << 2 * k) - 1;
+
+   unsigned long code = 0;
+   int len = sequence.length(), valid = 0;
+
+   for (int i = 0; i <= len; i++)
+   {
+      int base = (i < len ? baseSubscript(sequence[i]) : 4);
+
+      if (base <= 3)
+      {
+         code = (code << 2 | base) & mask;
+
+         if (++valid >= k)
+            kmers.push_back(code);
+
+         continue;
+      }
+
+      for (int n = std::min(valid, k - 1); n >= GENE_KMER_MIN; n--)
+         kmers.push_back((code & ((1UL << 2 * n) - 1)) << 2 * (k - n));
+
+      valid = 0;
+   }
+}
+
+//------------------------------------------------------------------------------------
+// getPartnerGenes() finds a hyphen in a label that separates the names of two genes
+// in the given map of gene subscripts; true is returned if found, in which case the
+// gene subscripts are stored in gene1 and gene2
+
+bool getPartnerGenes(const std::string& label,
+                     const std::unordered_map<std::string, int>& geneSub,
+                     int& gene1, int& gene2)
+{
+   for (size_t pos = label.find('-'); pos != std::string::npos;
+        pos = label.find('-', pos + 1))
+   {
+      std::unordered_map<std::string, int>::const_iterator it1, it2;
+
+      it1 = geneSub.find(label.substr(0, pos));
+      it2 = geneSub.find(label.substr(pos + 1));
+
+      if (it1 != geneSub.end() && it2 != geneSub.end())
+      {
+         gene1 = it1->second;
+         gene2 = it2->second;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+//------------------------------------------------------------------------------------
+// addGeneKmers() appends a (k-mer, gene) pair to a vector for each k-mer of a partner
+// gene sequence and of its reverse complement
+
+void addGeneKmers(const std::string& sequence, int gene,
+                  std::vector<std::pair<unsigned long, int> >& entry)
+{
+   if (gene < 0)
+      return; // not a partner gene
+
+   std::string rc(sequence.length(), 'N');
+   reverseComplement(sequence.c_str(), sequence.length(), &rc[0]);
+
+   std::vector<unsigned long> kmers;
+   getGeneKmers(sequence, kmers);
+   getGeneKmers(rc, kmers);
+
+   int numKmers = kmers.size();
+
+   for (int i = 0; i < numKmers; i++)
+      entry.push_back(std::make_pair(kmers[i], gene));
+}
+
+//------------------------------------------------------------------------------------
+// exactRunLength() returns the number of consecutive bases, at most GENE_KMER_LENGTH,
+// that any match of a target sequence is sure to share exactly with the read: a
+// match of overlap bases with s substitutions has s + 1 runs of exact bases between
+// them, one of which spans at least overlap / (s + 1) bases
+
+int exactRunLength(const Target *t)
+{
+   int run = GENE_KMER_LENGTH;
+
+   for (int i = 0; i < t->seqcount; i++)
+   {
+      int len = t->seqlen[i];
+
+      for (int overlap = len - allowedOverhang(len); overlap <= len; overlap++)
+         run = std::min(run, overlap / (scaledMaxsub(overlap, len) + 1));
+   }
+
+   return run;
+}
+
+//------------------------------------------------------------------------------------
+// readGeneSequences() reads the transcript sequences of the partner genes named in
+// the labels of the target pairs from a FASTA file, where the first word of each
+// header line is a gene name, and indexes the k-mers of each gene
+
+void readGeneSequences()
+{
+   std::unordered_map<std::string, int> geneSub;
+
+   for (int i = 0; i < numTargetPairs; i++) // collect possible gene names
+   {
+      const std::string& label = targetPair[i]->label;
+
+      for (size_t pos = label.find('-'); pos != std::string::npos;
+           pos = label.find('-', pos + 1))
+      {
+         geneSub[label.substr(0, pos)]  = -1;
+         geneSub[label.substr(pos + 1)] = -1;
+      }
+   }
+
+   std::ifstream in(genes_filename.c_str());
+
+   if (!in.is_open())
+      throw std::runtime_error("unable to open " + genes_filename);
+
+   std::vector<std::pair<unsigned long, int> > entry; // (k-mer, gene) pairs
+   std::string line, sequence;
+   int gene = -1;
+
+   while (std::getline(in, line))
+      if (line.length() > 0 && line[0] == '>')
+      {
+         addGeneKmers(sequence, gene, entry);
+         sequence = "";
+
+         std::string name;
+         std::stringstream stream(line.substr(1));
+         stream >> name;
+
+         std::unordered_map<std::string, int>::iterator it = geneSub.find(name);
+
+         if (it == geneSub.end())
+            gene = -1; // not a partner gene
+         else
+         {
+            if (it->second < 0)
+            {
+               it->second = geneName.size();
+               geneName.push_back(name);
+            }
+
+            gene = it->second;
+         }
+      }
+      else if (gene >= 0)
+         sequence += toupperSequence(line);
+
+   addGeneKmers(sequence, gene, entry);
+
+   for (std::unordered_map<std::string, int>::iterator it = geneSub.begin();
+        it != geneSub.end(); )
+      if (it->second < 0)
+         it = geneSub.erase(it); // not in the FASTA file
+      else
+         ++it;
+
+   std::sort(entry.begin(), entry.end());
+   entry.erase(std::unique(entry.begin(), entry.end()), entry.end());
+
+   int numEntries = entry.size();
+
+   for (int i = 0; i < numEntries; i++)
+   {
+      if (i == 0 || entry[i].first != entry[i - 1].first)
+      {
+         geneKmer.push_back(entry[i].first);
+         geneKmerStart.push_back(i);
+      }
+
+      geneKmerGene.push_back(entry[i].second);
+   }
+
+   geneKmerStart.push_back(numEntries);
+
+   // assign the partner genes to each input pair and its reverse complement
+
+   for (int i = 0; i < numTargetPairs; i++)
+   {
+      TargetPair *tp = targetPair[i];
+      int gene1, gene2;
+
+      if (tp->forward != tp || !getPartnerGenes(tp->label, geneSub, gene1, gene2))
+         continue;
+
+      // a target sequence shares too short a run of bases with every read it matches
+      // to filter the reads by gene
+
+      int leftRun  = exactRunLength(tp->left);
+      int rightRun = exactRunLength(tp->right);
+
+      if (!tp->left->want || leftRun < GENE_KMER_MIN)
+         gene1 = -1;
+      else
+         geneRunLength = std::min(geneRunLength, leftRun);
+
+      if (!tp->right->want || rightRun < GENE_KMER_MIN)
+         gene2 = -1;
+      else
+         geneRunLength = std::min(geneRunLength, rightRun);
+
+      TargetPair *rc = targetPair[i + 1]; // reverse complement follows
+
+      tp->leftGene  = rc->rightGene = gene1;
+      tp->rightGene = rc->leftGene  = gene2;
+   }
+
+   geneKmerIndex.build(geneKmer, geneRunLength < GENE_KMER_LENGTH);
+   geneFound.assign(geneName.size(), false);
+}
+
+//------------------------------------------------------------------------------------
+// addFoundGenes() marks the genes containing a gene k-mer as found in the read
+
+inline void addFoundGenes(int sub)
+{
+   int end = geneKmerStart[sub + 1];
+
+   for (int j = geneKmerStart[sub]; j < end; j++)
+      if (!geneFound[geneKmerGene[j]])
+      {
+         geneFound[geneKmerGene[j]] = true;
+         genesFound.push_back(geneKmerGene[j]);
+      }
+}
+
+//------------------------------------------------------------------------------------
+// findGenes() identifies the partner genes sharing a run of geneRunLength bases with
+// a read sequence; a shorter run than GENE_KMER_LENGTH is sought as the prefix of the
+// gene k-mers in a range found by the tree
+
+void findGenes(const std::string& readString)
+{
+   static std::vector<unsigned long> kmers;
+   static std::vector<int> subs;
+
+   int numFound = genesFound.size();
+
+   for (int i = 0; i < numFound; i++)
+      geneFound[genesFound[i]] = false;
+
+   genesFound.clear();
+   kmers.clear();
+   getKmers(readString, geneRunLength, kmers);
+
+   int numKmers = kmers.size();
+
+   if (geneRunLength == GENE_KMER_LENGTH)
+   {
+      geneKmerIndex.findAll(kmers, subs);
+
+      for (int i = 0; i < numKmers; i++)
+         if (subs[i] >= 0)
+            addFoundGenes(subs[i]);
+
+      return;
+   }
+
+   int shift = 2 * (GENE_KMER_LENGTH - geneRunLength);
+   int numGeneKmers = geneKmer.size();
+
+   for (int i = 0; i < numKmers; i++)
+   {
+      unsigned long first = kmers[i] << shift, last = first | ((1UL << shift) - 1);
+
+      for (int sub = geneKmerIndex.lowerBound(first);
+           sub < numGeneKmers && geneKmer[sub] <= last; sub++)
+         addFoundGenes(sub);
+   }
+}
+
+//------------------------------------------------------------------------------------
+// hasPartnerGenes() returns true if the partner genes of a target pair, if any, were
+// found in the current read
+
+inline bool hasPartnerGenes(const TargetPair *tp)
+{
+   return (tp->leftGene  < 0 || geneFound[tp->leftGene]) &&
+          (tp->rightGene < 0 || geneFound[tp->rightGene]);
+}
+
+//------------------------------------------------------------------------------------
+// buildSeedIndex() indexes the seeds of the target sequences; a target sequence of
+// length len is divided into maxsub + 1 seeds of length len / (maxsub + 1), or
+// MAX_SEED_LENGTH if less, one of which lies intact within any match to a read
+
+void buildSeedIndex()
+{
+   typedef std::vector<std::pair<unsigned long, SeedPosting> > SeedVector;
+   std::vector<SeedVector> entry(MAX_SEED_LENGTH + 1); // by seed length
+
+   for (int i = 0; i < numTargetPairs; i++)
+      for (int side = 0; side < 2; side++)
+      {
+         const Target *t = (side == 0 ? targetPair[i]->left : targetPair[i]->right);
+
+         for (int j = 0; j < t->seqcount; j++)
+         {
+            int k = std::min(t->seqlen[j] / (maxsub + 1), MAX_SEED_LENGTH);
+
+            if (k == 0)
+               throw std::runtime_error("target sequence too short to seed: " +
+                                        std::string(t->seq[j]));
+
+            for (int n = 0; n <= maxsub; n++)
+            {
+               SeedPosting posting = { 2 * i + side, j, n * k };
+               unsigned long code  = 0;
+
+               for (int m = 0; m < k; m++)
+                  code = code << 2 | baseSubscript(t->seq[j][n * k + m]);
+
+               entry[k].push_back(std::make_pair(code, posting));
+            }
+         }
+      }
+
+   for (int k = 1; k <= MAX_SEED_LENGTH; k++)
+   {
+      SeedVector& e = entry[k];
+      int numEntries = e.size();
+
+      if (numEntries == 0)
+         continue;
+
+      std::sort(e.begin(), e.end(),
+                [](const std::pair<unsigned long, SeedPosting>& a,
+                   const std::pair<unsigned long, SeedPosting>& b)
+                { return a.first < b.first; });
+
+      seedIndex.push_back(SeedIndex());
+      SeedIndex& si = seedIndex.back();
+      si.k = k;
+
+      for (int i = 0; i < numEntries; i++)
+      {
+         if (i == 0 || e[i].first != e[i - 1].first)
+         {
+            si.kmer.push_back(e[i].first);
+            si.first.push_back(i);
+         }
+
+         si.posting.push_back(e[i].second);
+      }
+
+      si.first.push_back(numEntries);
+      si.index.build(si.kmer);
+   }
+
+   seedScan.resize(numThreads);
+
+   for (int i = 0; i < numThreads; i++)
+      seedScan[i].state.assign(2 * numTargetPairs, SeedState());
+}
+
+//------------------------------------------------------------------------------------
+// isBetterSeedMatch() returns true if a match of a target sequence at a start index
+// of the current read is better than the best match of its target found so far in
+// the read: the one ending first for a left target, or starting last for a right
+// target, a tie going to the target sequence listed first
+
+inline bool isBetterSeedMatch(const Target *t, bool isLeft, int index, int start,
+                              const SeedState& state)
+{
+   if (state.read != sampledReads)
+      return true; // no match found so far
+
+   if (isLeft)
+   {
+      int end      = start + t->seqlen[index];
+      int stateEnd = state.start + t->seqlen[state.index];
+
+      return (end < stateEnd || (end == stateEnd && index < state.index));
+   }
+
+   return (start > state.start || (start == state.start && index < state.index));
+}
+
+//------------------------------------------------------------------------------------
+// extendSeed() verifies the target sequence of a seed where the seed places it in the
+// read sequence, provided that it would be the best match of its target found so far
+// in the scan and its junction lies within the junction range of its pair; the seeds
+// of a pair whose label has reached maxhits are ignored
+
+inline void extendSeed(SeedScan& scan, const SeedPosting& posting,
+                       const char *readseq, int readseqlen, int start)
+{
+   const TargetPair *tp = targetPair[posting.target >> 1];
+
+   if (isSaturated(tp))
+      return;
+
+   bool isLeft = ((posting.target & 1) == 0);
+   const Target *t = (isLeft ? tp->left : tp->right);
+
+   int len = t->seqlen[posting.index];
+
+   if (start < 0 || start + len > readseqlen)
+      return;
+
+   if (t->want)
+   {
+      int first, last; // a wanted target must border the junction range
+      tp->junctionRange(readseqlen, first, last);
+
+      int junction = (isLeft ? start + len : start);
+
+      if (junction < first || junction > last)
+         return;
+   }
+
+   SeedState& state = scan.state[posting.target];
+
+   if (!isBetterSeedMatch(t, isLeft, posting.index, start, state) ||
+       !isMatch(&readseq[start], t->seq[posting.index], len, maxsub))
+      return;
+
+   if (state.read != sampledReads &&
+       scan.state[posting.target ^ 1].read != sampledReads)
+      scan.pairs.push_back(posting.target >> 1); // first target of the pair found
+
+   state.read  = sampledReads;
+   state.index = posting.index;
+   state.start = start;
+}
+
+//------------------------------------------------------------------------------------
+// scanSeeds() finds the seeds starting at indexes first through last - 1 of a read
+// sequence a window at a time, extending each one found; a target sequence placed by
+// a seed is compared with the whole read, so a match spanning chunks is not missed
+
+void scanSeeds(SeedScan& scan, const char *readseq, int readseqlen, int first,
+               int last)
+{
+   int numIndexes = seedIndex.size();
+
+   scan.pairs.clear();
+
+   for (int x = 0; x < numIndexes; x++)
+   {
+      const SeedIndex& si = seedIndex[x];
+      const unsigned long mask = (si.k < 32 ? (1UL << 2 * si.k) - 1 : ~0UL);
+      const int end = std::min(readseqlen, last + si.k - 1); // end of the last seed
+
+      unsigned long code = 0;
+      int valid = 0; // number of consecutive A, C, G and T bases ending here
+
+      for (int i = first; i < end; )
+      {
+         scan.kmers.clear();
+         scan.position.clear();
+
+         for ( ; i < end && (int)scan.kmers.size() < SEED_WINDOW; i++)
+         {
+            int base = baseSubscript(readseq[i]);
+
+            if (base > 3)
+            {
+               valid = 0;
+               continue;
+            }
+
+            code = (code << 2 | base) & mask;
+
+            if (++valid >= si.k)
+            {
+               scan.kmers.push_back(code);
+               scan.position.push_back(i - si.k + 1);
+            }
+         }
+
+         si.index.findAll(scan.kmers, scan.subs);
+
+         int numKmers = scan.kmers.size();
+
+         for (int j = 0; j < numKmers; j++)
+            if (scan.subs[j] >= 0)
+            {
+               int stop = si.first[scan.subs[j] + 1];
+
+               for (int p = si.first[scan.subs[j]]; p < stop; p++)
+                  extendSeed(scan, si.posting[p], readseq, readseqlen,
+                             scan.position[j] - si.posting[p].offset);
+            }
+      }
+   }
+}
+
+//------------------------------------------------------------------------------------
+// findSeeds() finds the seeds of the target sequences in a read sequence, dividing a
+// long read into chunks scanned by separate threads and merging their best matches
+// into the first scan, and lists there in ascending order the subscripts of the
+// target pairs having a target found in the read
+
+void findSeeds(const std::string& readString)
+{
+   const char *readseq = readString.c_str();
+   int readseqlen      = readString.length();
+   int numChunks       = std::max(1, std::min(numThreads,
+                                              readseqlen / MIN_CHUNK_LENGTH));
+
+   std::vector<std::thread> thread;
+
+   for (int c = 1; c < numChunks; c++)
+      thread.push_back(std::thread(scanSeeds, std::ref(seedScan[c]), readseq,
+                                   readseqlen, (long)readseqlen * c / numChunks,
+                                   (long)readseqlen * (c + 1) / numChunks));
+
+   SeedScan& merged = seedScan[0];
+   scanSeeds(merged, readseq, readseqlen, 0, readseqlen / numChunks);
+
+   for (int c = 1; c < numChunks; c++)
+   {
+      thread[c - 1].join();
+
+      const SeedScan& scan = seedScan[c];
+      int numPairs = scan.pairs.size();
+
+      for (int i = 0; i < numPairs; i++)
+      {
+         int pairSub = scan.pairs[i];
+
+         if (merged.state[2 * pairSub].read != sampledReads &&
+             merged.state[2 * pairSub + 1].read != sampledReads)
+            merged.pairs.push_back(pairSub);
+
+         for (int side = 0; side < 2; side++)
+         {
+            const SeedState& state = scan.state[2 * pairSub + side];
+            const TargetPair *tp   = targetPair[pairSub];
+
+            if (state.read == sampledReads &&
+                isBetterSeedMatch(side == 0 ? tp->left : tp->right, side == 0,
+                                  state.index, state.start,
+                                  merged.state[2 * pairSub + side]))
+               merged.state[2 * pairSub + side] = state;
+         }
+      }
+   }
+
+   std::sort(merged.pairs.begin(), merged.pairs.end());
+}
+
+//------------------------------------------------------------------------------------
+// findSeededMatch() returns true if a target pair is found in the current read given
+// the best match of each of its targets, exactly as TargetPair::findMatch() would
+// find it without overhang, in which case match identifies the matching target
+// sequences
+
+bool findSeededMatch(int pairSub, int readseqlen, Match& match)
+{
+   const TargetPair *tp   = targetPair[pairSub];
+   const SeedState& left  = seedScan[0].state[2 * pairSub];
+   const SeedState& right = seedScan[0].state[2 * pairSub + 1];
+
+   bool leftFound  = (left.read  == sampledReads);
+   bool rightFound = (right.read == sampledReads);
+   int  leftEnd    = (leftFound ? left.start + tp->left->seqlen[left.index] : 0);
+
+   match.leftIndex = match.rightIndex = -1;
+
+   if (tp->left->want)
+   {
+      int rightpad = (tp->right->want ? tp->right->minseqlen : tp->right->maxseqlen);
+
+      if (!leftFound || leftEnd > readseqlen - rightpad)
+         return false;
+
+      match.leftIndex = left.index;
+      match.leftStart = left.start;
+
+      if (rightFound && right.start >= leftEnd)
+      {
+         match.rightIndex = right.index;
+         match.rightStart = right.start;
+      }
+
+      return ((match.rightIndex >= 0) == tp->right->want);
+   }
+
+   if (!rightFound || right.start < tp->left->maxseqlen)
+      return false;
+
+   match.rightIndex = right.index;
+   match.rightStart = right.start;
+
+   return !(leftFound && leftEnd <= right.start);
+}
+
+//------------------------------------------------------------------------------------
+// buildPrimerIndex() indexes the primers of the target pairs, each under its own
+// sequence and under every sequence differing from it by one substitution, and
+// widens the junction range of each primed pair by the slack
+
+void buildPrimerIndex()
+{
+   for (int i = 0; i < numTargetPairs; i++)
+   {
+      const std::string& primer = pairPrimer[i];
+      TargetPair *tp = targetPair[i];
+
+      if (primer == "")
+      {
+         unprimedPairs.push_back(i);
+         continue;
+      }
+
+      tp->minJunction = std::max(tp->minJunction - slack, 0);
+
+      if (tp->maxJunction < INT_MAX - slack)
+         tp->maxJunction += slack;
+
+      int  length = primer.length();
+      bool atEnd  = (tp->forward != tp);
+      int  x      = 0;
+
+      int numIndexes = primerIndex.size();
+
+      while (x < numIndexes &&
+             (primerIndex[x].length != length || primerIndex[x].atEnd != atEnd))
+         x++;
+
+      if (x == numIndexes)
+      {
+         primerIndex.push_back(PrimerIndex());
+         primerIndex[x].length = length;
+         primerIndex[x].atEnd  = atEnd;
+      }
+
+      unsigned long code = 0;
+
+      for (int j = 0; j < length; j++)
+         code = code << 2 | baseSubscript(primer[j]);
+
+      primerIndex[x].pairs[code].push_back(i);
+
+      for (int j = 0; j < length; j++)
+      {
+         int shift = 2 * (length - 1 - j);
+         unsigned long base = code >> shift & 3;
+
+         for (unsigned long b = 0; b < 4; b++)
+            if (b != base)
+               primerIndex[x].pairs[code ^ (base ^ b) << shift].push_back(i);
+      }
+   }
+}
+
+//------------------------------------------------------------------------------------
+// findPrimedPairs() lists in ascending order the subscripts of the target pairs to
+// seek in a read sequence: those whose primer starts the read, or whose reverse-
+// complemented primer ends it, with at most one substitution, and those unprimed; the
+// pairs of the primer alone are left in primedPairs
+
+void findPrimedPairs(const std::string& readString)
+{
+   int readseqlen = readString.length();
+   int numIndexes = primerIndex.size();
+
+   primedPairs.clear();
+
+   for (int x = 0; x < numIndexes; x++)
+   {
+      const PrimerIndex& pi = primerIndex[x];
+
+      if (pi.length > readseqlen)
+         continue;
+
+      int start = (pi.atEnd ? readseqlen - pi.length : 0);
+      const char *primer = readString.c_str() + start;
+      unsigned long code = 0;
+      int unknown = -1; // index of a base other than A, C, G or T
+      int j = 0;
+
+      for ( ; j < pi.length; j++)
+      {
+         int base = baseSubscript(primer[j]);
+
+         if (base > 3)
+         {
+            if (unknown >= 0)
+               break; // two substitutions
+            unknown = j;
+            base    = 0;
+         }
+
+         code = code << 2 | base;
+      }
+
+      if (j < pi.length)
+         continue;
+
+      std::unordered_map<unsigned long, std::vector<int> >::const_iterator it;
+
+      if (unknown < 0)
+      {
+         if ((it = pi.pairs.find(code)) != pi.pairs.end())
+            primedPairs.insert(primedPairs.end(), it->second.begin(),
+                               it->second.end());
+         continue;
+      }
+
+      // the unknown base is the one substitution allowed, so the primer is matched
+      // exactly elsewhere, and is listed under its own base at the unknown index
+
+      int shift = 2 * (pi.length - 1 - unknown);
+
+      for (int b = 0; b < 4; b++)
+         if ((it = pi.pairs.find(code | (unsigned long)b << shift)) != pi.pairs.end())
+         {
+            const std::vector<int>& pairs = it->second;
+            int numPairs = pairs.size();
+
+            for (int k = 0; k < numPairs; k++)
+               if (baseSubscript(pairPrimer[pairs[k]][unknown]) == b &&
+                   isMatch(primer, pairPrimer[pairs[k]].c_str(), pi.length, 1))
+                  primedPairs.push_back(pairs[k]);
+         }
+   }
+
+   if (!primedPairs.empty())
+      primedReads++;
+
+   // only the few primed pairs are sorted; the unprimed pairs are merged in order
+
+   std::sort(primedPairs.begin(), primedPairs.end());
+
+   pairsToSeek.resize(primedPairs.size() + unprimedPairs.size());
+   std::merge(primedPairs.begin(), primedPairs.end(), unprimedPairs.begin(),
+              unprimedPairs.end(), pairsToSeek.begin());
+}
+
+//------------------------------------------------------------------------------------
+// indexTargetPairs() builds the indexes that choose the target pairs to seek in each
+// read
+
+void indexTargetPairs()
+{
+   if (longMode)
+      buildSeedIndex();
+
+   if (ampliconMode)
+      buildPrimerIndex();
+}
+
+//------------------------------------------------------------------------------------
+// matchRead() seeks the target pairs in a read, recording the hits
+
+void matchRead(const BamTools::BamAlignment& alignment)
+{
+   Match match;
+
+   matchedBases += alignment.QueryBases.length();
+
+   if (genes_filename != "")
+      findGenes(alignment.QueryBases);
+
+   if (longMode)
+   {
+      findSeeds(alignment.QueryBases);
+
+      const std::vector<int>& seededPairs = seedScan[0].pairs;
+      int numSeededPairs = seededPairs.size();
+
+      for (int i = 0; i < numSeededPairs; i++)
+      {
+         const TargetPair *tp = targetPair[seededPairs[i]];
+
+         if (!isSaturated(tp) && hasPartnerGenes(tp) &&
+             findSeededMatch(seededPairs[i], alignment.QueryBases.length(), match))
+            recordHit(tp, alignment, match);
+      }
+   }
+   else if (ampliconMode)
+   {
+      findPrimedPairs(alignment.QueryBases);
+
+      int numPairsToSeek = pairsToSeek.size();
+
+      for (int i = 0; i < numPairsToSeek; i++)
+      {
+         const TargetPair *tp = targetPair[pairsToSeek[i]];
+
+         if (!isSaturated(tp) && hasPartnerGenes(tp) &&
+             findPairMatch(tp, alignment.QueryBases, match))
+            recordHit(tp, alignment, match);
+      }
+   }
+   else
+   {
+      int numActivePairs = activePair.size();
+
+      for (int i = 0; i < numActivePairs; i++)
+         if (!isSaturated(activePair[i]) && hasPartnerGenes(activePair[i]) &&
+             findPairMatch(activePair[i], alignment.QueryBases, match))
+            recordHit(activePair[i], alignment, match);
+   }
+
+   if (saturated)
+      removeSaturatedPairs();
+}
+
+//------------------------------------------------------------------------------------
+// estimateFraction() estimates the fraction of a coordinate-sorted BAM file that has
+// been read, given the last alignment read; -1 is returned if this is unknown, as it
+// is when the header does not declare the file sorted by coordinate
+
+double estimateFraction(const BamTools::BamReader& bamReader,
+                        const BamTools::BamAlignment& alignment)
+{
+   if (bamReader.GetHeader().SortOrder != "coordinate")
+      return -1.0;
+
+   const BamTools::RefVector& ref = bamReader.GetReferenceData();
+   int numRefs = ref.size();
+
+   if (alignment.RefID < 0 || alignment.RefID >= numRefs)
+      return -1.0; // unmapped reads follow the mapped reads
+
+   double total = 0.0, before = 0.0;
+
+   for (int i = 0; i < numRefs; i++)
+   {
+      if (i < alignment.RefID)
+         before += ref[i].RefLength;
+
+      total += ref[i].RefLength;
+   }
+
+   return (total > 0.0 ? (before + alignment.Position) / total : -1.0);
+}
+
+//------------------------------------------------------------------------------------
+// isPastDeadline() returns true if the deadline has been reached before a read, in
+// which case the fraction of the input scanned so far is estimated
+
+bool isPastDeadline(const BamTools::BamReader& bamReader,
+                    const BamTools::BamAlignment& alignment,
+                    std::chrono::steady_clock::time_point stopTime)
+{
+   if (deadline <= 0.0 || std::chrono::steady_clock::now() < stopTime)
+      return false;
+
+   deadlineReached = true;
+   scannedFraction = estimateFraction(bamReader, alignment);
+
+   return true;
+}
+
+//------------------------------------------------------------------------------------
+// sampleWindows() matches all reads starting in a random fraction of the windows of
+// the reference sequences, jumping to each sampled window using the BAM index, so
+// that only the BGZF blocks of these windows are decompressed; unmapped reads having
+// no position are not examined
+
+void sampleWindows(BamTools::BamReader& bamReader,
+                   std::chrono::steady_clock::time_point stopTime)
+{
+   const BamTools::RefVector& ref = bamReader.GetReferenceData();
+   int numRefs = ref.size();
+
+   for (int r = 0; r < numRefs; r++)
+      numWindows += (ref[r].RefLength + SAMPLE_WINDOW - 1) / SAMPLE_WINDOW;
+
+   BamTools::BamAlignment alignment;
+
+   std::mt19937 generator(SAMPLE_SEED);
+   std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+   for (int r = 0; r < numRefs; r++)
+      for (int start = 0; start < ref[r].RefLength; start += SAMPLE_WINDOW)
+      {
+         if (activePair.empty() || deadlineReached)
+            break;
+
+         if (uniform(generator) >= sampleFraction)
+            continue;
+
+         windowsSampled++;
+
+         int end = std::min(start + SAMPLE_WINDOW, ref[r].RefLength);
 
-void getDelimitedStrings(const std::string& s, char delimiter, StringVector& v)
-{
-   int i = 0, len = s.length();
+         if (!bamReader.SetRegion(r, start, r, end))
+            continue; // no reads in this window
 
-   do
-   {
-      std::string value = "";
+         while (!activePair.empty() && bamReader.GetNextAlignmentCore(alignment))
+         {
+            // a read overlapping the window is examined only in the window it starts
+            if (alignment.RefID != r || alignment.Position < start ||
+                alignment.Position >= end)
+               continue;
 
-      while (i < len && s[i] != delimiter)
-	 value += s[i++];
+            if (isPastDeadline(bamReader, alignment, stopTime))
+               break;
 
-      v.push_back(value);
-   }
-   while (i++ < len);
+            totalReads++;
+            sampledReads++;
+            alignment.BuildCharData();
+            matchRead(alignment);
+         }
+      }
 }
 
 //------------------------------------------------------------------------------------
-// isACGT() returns true if the given character is A, C, G or T
+// sampleReads() reads every read of a BAM file in turn, matching a random fraction of
+// them (or all of them if not sampling)
 
-bool isACGT(char ch)
+void sampleReads(BamTools::BamReader& bamReader,
+                 std::chrono::steady_clock::time_point stopTime)
 {
-   ch = std::toupper(ch);
+   BamTools::BamAlignment alignment;
 
-   return (ch == 'A' || ch == 'C' || ch == 'G' || ch == 'T');
-}
+   std::mt19937 generator(SAMPLE_SEED);
+   std::uniform_real_distribution<double> uniform(0.0, 1.0);
 
-//------------------------------------------------------------------------------------
-// isAllACGT() returns true if all characters in the sequence are A, C, G or T
+   while (!activePair.empty() && bamReader.GetNextAlignmentCore(alignment))
+   {
+      if (isPastDeadline(bamReader, alignment, stopTime))
+         break;
 
-bool isAllACGT(const std::string& sequence)
-{
-   int len = sequence.length();
+      totalReads++;
 
-   for (int i = 0; i < len; i++)
-      if (!isACGT(sequence[i]))
-         return false;
+      // the name, bases and tags of a read are decoded only if it is sampled
+      if (sampleFraction < 1.0 && uniform(generator) >= sampleFraction)
+         continue;
 
-   return true;
+      sampledReads++;
+      alignment.BuildCharData();
+      matchRead(alignment);
+   }
 }
 
 //------------------------------------------------------------------------------------
-// Target::Target() parses the given string to obtain one or more target sequences and
-// saves them in the new object it is constructing
+// readBamFile() reads a BAM file and writes hits to stdout
 
-Target::Target(const std::string& targetString)
+void readBamFile()
 {
-   std::string s = toupperSequence(targetString);
+   BamTools::BamReader bamReader;
 
-   if (s.length() > 0 && s[0] == '-')
+   if (!bamReader.Open(bam_filename))
+      throw std::runtime_error("unable to open " + bam_filename);
+
+   readTargetPairs(std::cin);
+
+   if (genes_filename != "")
+      readGeneSequences();
+
+   indexTargetPairs();
+
+   if (readGroupMode) // list the read groups in the header first
    {
-      want = false;
-      s = s.substr(1);
+      BamTools::SamHeader header = bamReader.GetHeader();
+
+      for (BamTools::SamReadGroupConstIterator it = header.ReadGroups.ConstBegin();
+           it != header.ReadGroups.ConstEnd(); ++it)
+         getReadGroupSub(it->ID);
    }
-   else
-      want = true;
 
-   StringVector t;
-   getDelimitedStrings(s, '|', t);
+   std::chrono::steady_clock::time_point stopTime = std::chrono::steady_clock::now() +
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+         std::chrono::duration<double>(deadline));
 
-   seqcount  = t.size();
-   minseqlen = t[0].length();
-   maxseqlen = t[0].length();
+   // with an index, only the sampled windows of the BAM file are decompressed
 
-   for (int i = 1; i < seqcount; i++)
-      if (t[i].length() < minseqlen)
-         minseqlen = t[i].length();
-      else if (t[i].length() > maxseqlen)
-         maxseqlen = t[i].length();
+   if (sampleFraction < 1.0 && bamReader.LocateIndex() && bamReader.HasIndex())
+      sampleWindows(bamReader, stopTime);
+   else
+      sampleReads(bamReader, stopTime);
 
-   if (minseqlen < MIN_TARGET_LENGTH)
-      throw std::runtime_error("invalid sequence length in " + targetString);
+   bamReader.Close();
 
-   for (int i = 0; i < seqcount; i++)
-      if (!isAllACGT(t[i]))
-         throw std::runtime_error("invalid character in " + t[i]);
+   if (clusterMode)
+      writeClusters();
 
-   seqlen = new int[seqcount];
-   seq    = new char *[seqcount];
+   if (counts_filename != "")
+      writeCounts();
 
-   for (int i = 0; i < seqcount; i++)
-   {
-      seqlen[i] = t[i].length();
-      seq[i]    = new char[seqlen[i] + 1];
-      std::strcpy(seq[i], t[i].c_str());
-   }
+   if (matrix_prefix != "")
+      writeCellMatrix();
 }
 
 //------------------------------------------------------------------------------------
-// Target::~Target() de-allocates the arrays allocated by the constructor
+// ReadStore::bytes() returns the number of bytes of memory holding the reads
 
-Target::~Target()
+size_t ReadStore::bytes() const
 {
-   for (int i = 0; i < seqcount; i++)
-      delete[] seq[i];
-
-   delete[] seq;
-   delete[] seqlen;
+   return base.size() + otherBase.size() + name.size() +
+          (baseStart.size() + otherStart.size() + nameStart.size()) * sizeof(long) +
+          otherIndex.size() * sizeof(int);
 }
 
 //------------------------------------------------------------------------------------
-// reverseSequence() reverses the order of the characters in a sequence
+// loadReadStore() reads the names and bases of all reads in a BAM file into memory;
+// an exception is thrown if the file cannot be opened
 
-std::string reverseSequence(const std::string& sequence)
+ReadStore *loadReadStore(const std::string& filename)
 {
-   std::string reverseSeq = "";
-
-   int len = sequence.length();
+   BamTools::BamReader bamReader;
 
-   for (int i = len - 1; i >= 0; i--)
-      reverseSeq += sequence[i];
+   if (!bamReader.Open(filename))
+      throw std::runtime_error("unable to open " + filename);
 
-   return reverseSeq;
-}
+   ReadStore *store = new ReadStore;
+   store->filename  = filename;
 
-//------------------------------------------------------------------------------------
-// invertSequence() swaps A and T, and C and G in the sequence
+   BamTools::BamAlignment alignment;
+   long numBases = 0;
 
-std::string invertSequence(const std::string& sequence)
-{
-   std::string inverseSeq = "";
+   while (bamReader.GetNextAlignment(alignment))
+   {
+      const std::string& bases = alignment.QueryBases;
+      int len = bases.length();
 
-   int len = sequence.length();
+      store->baseStart.push_back(numBases);
+      store->otherStart.push_back(store->otherIndex.size());
+      store->nameStart.push_back(store->name.length());
+      store->name += alignment.Name;
 
-   for (int i = 0; i < len; i++)
-   {
-      char ch;
+      store->base.resize((numBases + len + 3) / 4, 0);
 
-      switch (sequence[i])
+      for (int i = 0; i < len; i++, numBases++)
       {
-         case 'A': ch = 'T'; break;
-	 case 'a': ch = 't'; break;
+         int code = baseSubscript(bases[i]);
 
-	 case 'T': ch = 'A'; break;
-	 case 't': ch = 'a'; break;
+         if (code > 3)
+         {
+            store->otherIndex.push_back(i);
+            store->otherBase.push_back(bases[i]);
+            code = 0;
+         }
 
-         case 'C': ch = 'G'; break;
-	 case 'c': ch = 'g'; break;
+         store->base[numBases >> 2] |= code << 2 * (numBases & 3);
+      }
+   }
 
-	 case 'G': ch = 'C'; break;
-	 case 'g': ch = 'c'; break;
+   bamReader.Close();
 
-	 default : ch = sequence[i];
-      }
+   store->baseStart.push_back(numBases);
+   store->otherStart.push_back(store->otherIndex.size());
+   store->nameStart.push_back(store->name.length());
 
-      inverseSeq += ch;
-   }
+   store->base.shrink_to_fit();
+   store->baseStart.shrink_to_fit();
+   store->otherStart.shrink_to_fit();
+   store->otherIndex.shrink_to_fit();
+   store->otherBase.shrink_to_fit();
+   store->name.shrink_to_fit();
+   store->nameStart.shrink_to_fit();
 
-   return inverseSeq;
+   return store;
 }
 
 //------------------------------------------------------------------------------------
-// Target::reverseComplement() returns a string representing the reverse complement of
-// the target sequence(s)
+// unpackRead() gets the name and bases of a read kept in memory; the bases are
+// unpacked a byte (four bases) at a time once aligned
 
-std::string Target::reverseComplement() const
+void unpackRead(const ReadStore& store, long r, BamTools::BamAlignment& alignment)
 {
-   std::string revcomp = (want ? "" : "-");
+   const char BASE[] = "ACGT";
 
-   for (int i = 0; i < seqcount; i++)
+   static char unpacked[256][4]; // four bases of each byte value
+   static bool tableBuilt = false;
+
+   if (!tableBuilt)
    {
-      std::string temp = seq[i];
-      temp = reverseSequence(temp);
-      temp = invertSequence(temp);
+      for (int b = 0; b < 256; b++)
+         for (int i = 0; i < 4; i++)
+            unpacked[b][i] = BASE[b >> 2 * i & 3];
 
-      revcomp += (i > 0 ? "|" + temp : temp);
+      tableBuilt = true;
    }
 
-   return revcomp;
-}
+   alignment.Name.assign(store.name, store.nameStart[r],
+                         store.nameStart[r + 1] - store.nameStart[r]);
 
-//------------------------------------------------------------------------------------
-// isMatch() performs a fuzzy match of two sequences; it returns true if the target
-// sequence matches the read sequence with no more than maxsub substitutions
+   long start = store.baseStart[r];
+   long end   = store.baseStart[r + 1];
 
-inline bool isMatch(const char *readseq, const char *target, int targetlen)
-{
-   int numsubs = 0;
+   std::string& bases = alignment.QueryBases;
+   bases.resize(end - start);
 
-   for (int i = 0; i < targetlen; i++)
-      if (readseq[i] != target[i] && ++numsubs > maxsub)
-         return false;
+   char *out = &bases[0];
+   long b    = start;
 
-   return true;
+   for ( ; b < end && (b & 3) != 0; b++)
+      *out++ = BASE[store.base[b >> 2] >> 2 * (b & 3) & 3];
+
+   for ( ; b + 4 <= end; b += 4, out += 4)
+      std::memcpy(out, unpacked[store.base[b >> 2]], 4);
+
+   for ( ; b < end; b++)
+      *out++ = BASE[store.base[b >> 2] >> 2 * (b & 3) & 3];
+
+   for (long i = store.otherStart[r]; i < store.otherStart[r + 1]; i++)
+      bases[store.otherIndex[i]] = store.otherBase[i];
 }
 
 //------------------------------------------------------------------------------------
-// Target::findLeftmost() identifies the target sequence that matches the given read
-// sequence with its last base farthest left in the read sequence (leaving the most
-// opportunity to find a match to the right); if found, true is returned, matchIndex
-// is set to the subscript identifying the matching target sequence, and matchStart is
-// set to the start index of the match within the read sequence
+// getReadStore() returns the reads of a BAM file, which are loaded into memory unless
+// they are already there, as indicated by cached
 
-bool Target::findLeftmost(const char *readseq, int readseqlen, int rightpad,
-                          int& matchIndex, int& matchStart) const
+ReadStore *getReadStore(const std::string& filename, bool& cached)
 {
-   matchIndex = -1; // no match found yet
+   ReadStore *store = NULL;
+   int numStores = readStore.size();
 
-   int lastMatchEnd = readseqlen - rightpad; // exclusive end point
+   for (int i = 0; i < numStores && !store; i++)
+      if (readStore[i]->filename == filename)
+         store = readStore[i];
 
-   for (int i = 0; i < seqcount; i++)
-   {
-      int lastStart = lastMatchEnd - seqlen[i];
+   cached = (store != NULL);
 
-      for (int start = 0; start <= lastStart; start++)
-         if (isMatch(&readseq[start], seq[i], seqlen[i]))
-	 {
-            matchIndex   = i;
-	    matchStart   = start;
-	    lastMatchEnd = start + seqlen[i] - 1;
-	    break;
-	 }
+   if (!cached)
+   {
+      store = loadReadStore(filename);
+      readStore.push_back(store);
    }
 
-   return (matchIndex >= 0);
+   store->lastQuery = queryNumber;
+
+   return store;
 }
 
 //------------------------------------------------------------------------------------
-// Target::findRightmost() identifies the target sequence that matches the given read
-// sequence with its first base farthest right in the read sequence (leaving the most
-// opportunity to find a match to the left); if found, true is returned, matchIndex
-// is set to the subscript identifying the matching target sequence, and matchStart is
-// set to the start index of the match within the read sequence
+// evictReadStores() removes the reads of the least recently queried BAM files from
+// memory until the rest fit within the memory budget
 
-bool Target::findRightmost(const char *readseq, int readseqlen, int leftpad,
-                           int& matchIndex, int& matchStart) const
+void evictReadStores()
 {
-   matchIndex = -1; // no match found yet
+   size_t budget = (size_t)memoryBudget << 20;
+   size_t total  = 0;
+   int numStores = readStore.size();
 
-   int lastMatchStart = leftpad; // inclusive starting point
+   for (int i = 0; i < numStores; i++)
+      total += readStore[i]->bytes();
 
-   for (int i = 0; i < seqcount; i++)
+   while (total > budget && numStores > 0)
    {
-      int firstStart = readseqlen - seqlen[i];
+      int lru = 0;
 
-      for (int start = firstStart; start >= lastMatchStart; start--)
-         if (isMatch(&readseq[start], seq[i], seqlen[i]))
-	 {
-            matchIndex     = i;
-	    matchStart     = start;
-	    lastMatchStart = start + 1;
-	    break;
-	 }
-   }
+      for (int i = 1; i < numStores; i++)
+         if (readStore[i]->lastQuery < readStore[lru]->lastQuery)
+            lru = i;
 
-   return (matchIndex >= 0);
+      total -= readStore[lru]->bytes();
+
+      delete readStore[lru];
+      readStore.erase(readStore.begin() + lru);
+      numStores--;
+   }
 }
 
 //------------------------------------------------------------------------------------
-// TargetPair::TargetPair() gets the left and right target sequences from the input
-// strings; an exception is thrown if there is something wrong
+// resetQuery() discards the target pairs and results of the previous daemon query;
+// the label counts are destroyed first, since they own memory outside the arena
 
-TargetPair::TargetPair(const std::string& inLabel,
-                       const std::string& leftTargetString,
-                       const std::string& rightTargetString)
-   : label(inLabel), left(new Target(leftTargetString)),
-     right(new Target(rightTargetString))
+void resetQuery()
 {
-   if (label.length() == 0)
-      throw std::runtime_error("missing label before " + leftTargetString);
+   int numLabels = labelCounts.size();
 
-   if (!left->want && !right->want)
-      throw std::runtime_error("double negative specified for " + label);
-}
-
-//------------------------------------------------------------------------------------
-// TargetPair::createReverseComplement() returns a TargetPair object that represents
-// the reverse complement of this one
+   for (int i = 0; i < numLabels; i++)
+      delete labelCounts[i]; // frees its tallies; its memory is owned by targetArena
 
-TargetPair *TargetPair::createReverseComplement() const
-{
-   std::string leftTargetString  = right->reverseComplement();
-   std::string rightTargetString = left ->reverseComplement();
+   targetPair.clear();
+   activePair.clear();
+   labelCounts.clear();
+   labelPool.clear();
+   numTargetPairs = 0;
 
-   return new TargetPair(label, leftTargetString, rightTargetString);
-}
+   seedIndex.clear();
+   seedScan.clear();
 
-//------------------------------------------------------------------------------------
-// TargetPair::findMatch() determines whether this target pair can be found in the
-// given read sequence; if so, the read sequence is written with the matches
-// highlighted
+   pairPrimer.clear();
+   primerIndex.clear();
+   unprimedPairs.clear();
 
-void TargetPair::findMatch(const std::string& readName,
-                           const std::string& readString) const
-{
-   const char *readseq = readString.c_str();
-   int readseqlen      = readString.length();
+   cluster.clear();
+   clusterKey.clear();
 
-   int leftIndex, leftStart, rightIndex, rightStart;
+   saturated = false;
 
-   if (left->want &&
-       left->findLeftmost(readseq, readseqlen,
-                          (right->want ? right->minseqlen : right->maxseqlen),
-                          leftIndex, leftStart) &&
-       right->findRightmost(readseq, readseqlen, leftStart + left->seqlen[leftIndex],
-                            rightIndex, rightStart) == right->want ||
-       !left->want &&
-       right->findRightmost(readseq, readseqlen, left->maxseqlen,
-                            rightIndex, rightStart) &&
-       !left->findLeftmost (readseq, readseqlen, readseqlen - rightStart,
-                           leftIndex, leftStart))
-   {
-      writeMatch(readName, readString, leftIndex, leftStart, rightIndex, rightStart);
-   }
+   targetArena.release();
 }
 
 //------------------------------------------------------------------------------------
-// highlight() highlights a match as it is written to stdout
+// runQuery() seeks the target pairs of a panel file in the reads of a BAM file, kept
+// in memory, writing the hits to an output file and a summary to stderr; an exception
+// is thrown if there is something wrong
 
-void highlight(std::string readString, const char *target)
+void runQuery(const StringVector& field, const char *progname)
 {
-   std::cout << "[";
+   std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
 
-   int len = readString.length();
+   resetQuery();
+   queryNumber++;
 
-   for (int i = 0; i < len; i++)
-      std::cout << (char)(readString[i] == target[i] ?
-                          readString[i] : std::tolower(readString[i]));
+   std::ifstream panel(field[1].c_str());
 
-   std::cout << "]";
-}
+   if (!panel.is_open())
+      throw std::runtime_error("unable to open " + field[1]);
 
-//------------------------------------------------------------------------------------
-// TargetPair::writeMatch() writes a hit to stdout
+   readTargetPairs(panel);
+   indexTargetPairs();
 
-void TargetPair::writeMatch(const std::string& readName,
-                            const std::string& readString,
-                            int leftIndex,  int leftStart,
-			    int rightIndex, int rightStart) const
-{
-   std::cout << readName << "\t";
+   bool cached;
+   const ReadStore *store = getReadStore(field[0], cached);
+   long numReads = store->baseStart.size() - 1;
 
-   int initialBases = (left->want ? leftStart : rightStart);
+   int fd = open(field[2].c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
 
-   if (initialBases > 0)
-      std::cout << readString.substr(0, initialBases);
+   if (fd < 0)
+      throw std::runtime_error("unable to create " + field[2]);
 
-   if (left->want)
+   output.redirect(fd);
+
+   try
    {
-      int leftlen = left->seqlen[leftIndex];
-      
-      highlight(readString.substr(leftStart, leftlen), left->seq[leftIndex]);
+      BamTools::BamAlignment alignment;
 
-      int nextlen =
-         (right->want ? rightStart : readString.length()) - leftStart - leftlen;
+      for (long r = 0; r < numReads && !activePair.empty(); r++)
+      {
+         unpackRead(*store, r, alignment);
 
-      if (nextlen > 0)
-         std::cout << readString.substr(leftStart + leftlen, nextlen);
-   }
+         totalReads++;
+         sampledReads++;
+         matchRead(alignment);
+      }
 
-   if (right->want)
+      if (clusterMode)
+         writeClusters();
+
+      output.close();
+   }
+   catch (...)
    {
-      int rightlen = right->seqlen[rightIndex];
+      output.discard();
+      output.redirect(STDOUT_FILENO);
+      close(fd);
+      throw;
+   }
 
-      highlight(readString.substr(rightStart, rightlen), right->seq[rightIndex]);
+   output.redirect(STDOUT_FILENO);
+   close(fd);
 
-      int nextlen = readString.length() - rightStart - rightlen;
+   long hits = 0;
+   int numLabels = labelCounts.size();
 
-      if (nextlen > 0)
-         std::cout << readString.substr(rightStart + rightlen, nextlen);
-   }
+   for (int i = 0; i < numLabels; i++)
+      hits += labelCounts[i]->hits;
+
+   std::cerr << progname << ": " << field[2] << ": " << hits << " hits in "
+             << numReads << " reads "
+             << (cached ? "in memory, " : "loaded from " + field[0] + ", ")
+             << std::fixed << std::setprecision(2)
+             << std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - startTime).count()
+             << " seconds" << std::endl;
 
-   std::cout << "\t" << label << "\n";
+   evictReadStores();
 }
 
 //------------------------------------------------------------------------------------
-// readTargetPairs() reads a list of target pairs from stdin and stores each pair and
-// its reverse complement in a vector of target pairs
+// runDaemon() answers queries read from stdin, one per line, each consisting of the
+// names of a BAM file, a panel file of target pairs, and an output file; the reads of
+// the BAM files queried most recently are kept in memory for the next queries
 
-void readTargetPairs()
+void runDaemon(const char *progname)
 {
    std::string line;
 
    while (std::getline(std::cin, line))
    {
-      StringVector column;
-      getDelimitedStrings(line, '\t', column);
+      std::stringstream stream(line);
+      StringVector field;
+      std::string word;
 
-      if (column.size() != 3)
-         throw std::runtime_error("unexpected #columns in " + line);
+      while (stream >> word)
+         field.push_back(word);
 
-      TargetPair *tp = new TargetPair(column[0], column[1], column[2]);
+      if (field.empty())
+         continue;
 
-      targetPair.push_back(tp);
-      targetPair.push_back(tp->createReverseComplement());
+      try
+      {
+         if (field.size() != 3)
+            throw std::runtime_error("expected bam_file panel_file output_file in " +
+                                     line);
+         runQuery(field, progname);
+      }
+      catch (const std::runtime_error& error)
+      {
+         std::cerr << progname << ": " << error.what() << std::endl;
+      }
    }
+}
 
-   numTargetPairs = targetPair.size();
+//------------------------------------------------------------------------------------
+// openTLBCounter() starts counting the data TLB misses of this process, returning a
+// file descriptor for reading the count, or -1 if the count is unavailable
 
-   if (numTargetPairs == 0)
-      throw std::runtime_error("no input targets");
+int openTLBCounter()
+{
+#ifdef __linux__
+   struct perf_event_attr attr;
+   std::memset(&attr, 0, sizeof(attr));
+
+   attr.size   = sizeof(attr);
+   attr.type   = PERF_TYPE_HW_CACHE;
+   attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                 PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                 PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+
+   attr.exclude_kernel = 1;
+   attr.exclude_hv     = 1;
+
+   return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+   return -1;
+#endif
 }
 
 //------------------------------------------------------------------------------------
-// readBamFile() reads a BAM file and writes hits to stdout
+// hugePageKB() returns the kilobytes of this process's memory in transparent huge
+// pages, or -1 if unknown
 
-void readBamFile()
+long hugePageKB()
 {
-   BamTools::BamReader bamReader;
+   std::ifstream in("/proc/self/smaps_rollup");
+   std::string line;
 
-   if (!bamReader.Open(bam_filename))
-      throw std::runtime_error("unable to open " + bam_filename);
+   while (std::getline(in, line))
+      if (line.substr(0, 14) == "AnonHugePages:")
+      {
+         long kb = -1;
+         std::stringstream stream(line.substr(14));
+         stream >> kb;
+         return kb;
+      }
 
-   readTargetPairs();
+   return -1;
+}
 
-   BamTools::BamAlignment alignment;
+//------------------------------------------------------------------------------------
+// writeStats() writes statistics about this run to stderr
 
-   while (bamReader.GetNextAlignment(alignment))
-      for (int i = 0; i < numTargetPairs; i++)
-         targetPair[i]->findMatch(alignment.Name, alignment.QueryBases);
+void writeStats(const char *progname, double seconds, int tlbCounter)
+{
+   std::cerr << progname << ": " << totalReads << " reads examined in "
+             << std::fixed << std::setprecision(2) << seconds << " seconds"
+             << std::endl;
 
-   bamReader.Close();
+   std::cerr << progname << ": " << matchedBases << " bases matched, "
+             << std::setprecision(0) << (seconds > 0.0 ? matchedBases / seconds : 0.0)
+             << " bases per second" << std::endl;
+
+   std::cerr << progname << ": huge pages "
+             << (hugePages ? "enabled" : "disabled");
+
+   long kb = hugePageKB();
+
+   if (kb >= 0)
+      std::cerr << ", " << kb << " KB of memory in transparent huge pages";
+
+   std::cerr << std::endl;
+
+   long long misses = 0;
+
+#ifdef __linux__
+   if (tlbCounter >= 0 && read(tlbCounter, &misses, sizeof(misses)) == sizeof(misses))
+      std::cerr << progname << ": " << misses << " data TLB load misses" << std::endl;
+   else
+#endif
+      std::cerr << progname << ": data TLB load misses unavailable" << std::endl;
+
+   if (!geneKmer.empty())
+      std::cerr << progname << ": " << geneKmer.size() << " gene k-mers in a "
+                << (geneKmerIndex.usesTree() ? "sorted tree" : "hash table")
+                << ", seeking runs of " << geneRunLength << " bases" << std::endl;
+
+   if (ampliconMode)
+      std::cerr << progname << ": " << primedReads << " of " << sampledReads
+                << " reads have a known primer" << std::endl;
+
+   if (outcompress != "")
+      std::cerr << progname << ": " << output.bytesIn
+                << " bytes of output compressed to " << output.bytesOut << std::endl;
 }
 
 //------------------------------------------------------------------------------------
@@ -573,15 +4550,61 @@ int main(int argc, char *argv[])
       return 1;
    }
 
+   std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+   int tlbCounter = (showStats ? openTLBCounter() : -1);
+
    try
    {
+      if (optimizeMode)
+      {
+         optimizeTargetPairs(argv[0]);
+         return 0;
+      }
+
+      if (daemonMode)
+      {
+         runDaemon(argv[0]);
+         return 0;
+      }
+
       readBamFile();
+      output.flush();
    }
    catch (const std::runtime_error& error)
    {
       std::cerr << argv[0] << ": " << error.what() << std::endl;
+
+      try
+      {
+         output.flush(); // keep the matches already found
+      }
+      catch (const std::runtime_error&)
+      {
+      }
+
       return 1;
    }
 
+   if (showStats)
+      writeStats(argv[0], std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - startTime).count(),
+                 tlbCounter);
+
+   if (deadlineReached)
+   {
+      std::cerr << argv[0] << ": deadline reached after " << totalReads << " reads";
+
+      if (scannedFraction >= 0.0)
+         std::cerr << ", about " << std::fixed << std::setprecision(1)
+                   << 100.0 * scannedFraction << "% of the input";
+      else
+         std::cerr << ", unknown fraction of the input";
+
+      std::cerr << std::endl;
+
+      return PARTIAL_STATUS;
+   }
+
    return 0;
 }